@@ -37,8 +37,27 @@
 /* $Id: header,v 1.16.2.1.2.1 2007/01/01 19:32:09 iliaa Exp $ */
 
 #include "zend_smart_str.h"
+#include "zend_interfaces.h"
+#include "zend_exceptions.h"
+#include "ext/standard/base64.h"
 #include "php_peb.h"
 
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 /****************************************
   macros define
 ****************************************/
@@ -46,17 +65,264 @@
 ZEND_DECLARE_MODULE_GLOBALS(peb)
 
 /* True global resources - no need for thread safety here */
-static int  le_link, le_plink, le_msgbuff, le_serverpid;
+static int  le_link, le_plink, le_msgbuff, le_serverpid, le_rpc;
 static int  fd;
 
+static zend_class_entry*        peb_term_ce;
+static zend_object_handlers     peb_term_handlers;
+
+static zend_object* peb_term_create(zend_class_entry* ce);
+static void peb_term_free(zend_object* object);
+static zend_object_iterator* peb_term_get_iterator(zend_class_entry* ce, zval* object, int by_ref);
+
+static zend_class_entry*        peb_list_ce;
+static zend_object_handlers     peb_list_handlers;
+
+static zend_object* peb_list_create(zend_class_entry* ce);
+static void peb_list_free(zend_object* object);
+static zend_object_iterator* peb_list_get_iterator(zend_class_entry* ce, zval* object, int by_ref);
+
+static void _peb_schema_dtor(zval* zv);
+static int _peb_x_put_term(ei_x_buff* x, const ei_x_buff* term);
+static zend_long _peb_now_ms(void);
+static zend_string* _peb_latin1_to_utf8(const unsigned char* p, size_t n);
+static char* _peb_x_reserve(ei_x_buff* x, size_t n);
+static int _peb_x_put_atom(ei_x_buff* x, const char* p, size_t len);
+
+typedef struct _peb_pool peb_pool;
+
 typedef struct _peb_link {
     ei_cnode*       ec;
     char*           node;
     char*           secret;
     int             fd;
     int             is_persistent;
+    zend_long       tmo;            /* connect timeout, kept for reconnects */
+    time_t          used;           /* last handed out or connected */
+    peb_pool*       pool;           /* pool the link belongs to, or NULL */
+    uint32_t        in_use;         /* checkouts from the pool */
 } peb_link;
 
+/*
+ * Links to one node, kept per worker and checked out by peb_pool_acquire()
+ */
+struct _peb_pool {
+    uint32_t        count;          /* links open */
+    uint32_t        min;
+    uint32_t        max;
+    uint32_t        next;           /* round-robin cursor */
+    peb_link*       links[1];
+};
+
+/*
+ * Asynchronous RPC call, see peb_rpc_async()
+ */
+#define PEB_RPC_PENDING         0
+#define PEB_RPC_DONE            1       /* reply is in reply */
+#define PEB_RPC_FAILED          2
+#define PEB_RPC_TAKEN           3       /* reply handed out */
+
+typedef struct _peb_rpc_handle {
+    zend_resource*  link_res;       /* referenced, the link may be closed meanwhile */
+    peb_link*       link;
+    zend_ulong      seq;            /* key in PEB_G(rpc_pending), part of the ref */
+    int             state;
+    ei_x_buff       reply;
+} peb_rpc_handle;
+
+/*
+ * Compiled format program
+ */
+#define PEB_OP_ATOM             1       /* ~a */
+#define PEB_OP_STRING           2       /* ~s */
+#define PEB_OP_BINARY           3       /* ~b */
+#define PEB_OP_LONG             4       /* ~i, ~l, ~u */
+#define PEB_OP_DOUBLE           5       /* ~f, ~d */
+#define PEB_OP_LINK             6       /* ~p, self pid of a peb link */
+#define PEB_OP_PID              7       /* ~P */
+#define PEB_OP_NIL              8       /* [] */
+#define PEB_OP_TUPLE            9       /* {, arg is the arity */
+#define PEB_OP_LIST             10      /* [, arg is the length */
+#define PEB_OP_TUPLE_END        11      /* }, arg is the index of the opening op */
+#define PEB_OP_LIST_END         12      /* ] */
+#define PEB_OP_MAP              13      /* #{, arg is twice the arity */
+#define PEB_OP_MAP_END          14      /* } */
+
+#ifndef CONST_CS
+#define CONST_CS                0       /* constants are always case sensitive since PHP 8 */
+#endif
+
+#ifdef IOV_MAX
+#define PEB_IOV_MAX             IOV_MAX
+#else
+#define PEB_IOV_MAX             1024    /* iovecs per sendmsg() */
+#endif
+
+#ifndef GC_ADDREF
+#define GC_ADDREF(p)            (++GC_REFCOUNT(p))      /* PHP < 7.3 */
+#endif
+
+#define PEB_VEC_FLOAT64         1       /* peb_pack_vector() element types */
+#define PEB_VEC_FLOAT32         2
+#define PEB_VEC_INT64           3
+#define PEB_VEC_INT32           4
+#define PEB_VEC_INT16           5
+
+/*
+ * Term classes of the external term format tags, see peb_term_class[]
+ */
+#define PEB_T_INVALID           0
+#define PEB_T_SMALL_INT         1
+#define PEB_T_INT               2
+#define PEB_T_NEW_FLOAT         3
+#define PEB_T_FLOAT             4
+#define PEB_T_ATOM              5
+#define PEB_T_STRING            6
+#define PEB_T_BINARY            7
+#define PEB_T_BIG               8
+#define PEB_T_PID               9
+#define PEB_T_TUPLE             10
+#define PEB_T_NIL               11
+#define PEB_T_LIST              12
+#define PEB_T_MAP               13
+#define PEB_T_OPAQUE            14      /* refs, ports, funs, bit binaries */
+
+#define PEB_S_INT               1       /* schema field types */
+#define PEB_S_FLOAT             2
+#define PEB_S_BOOL              3
+#define PEB_S_ATOM              4
+#define PEB_S_BINARY            5
+#define PEB_S_STRING            6
+#define PEB_S_PID               7
+#define PEB_S_TERM              8
+#define PEB_S_SCHEMA            9       /* @name */
+
+#define PEB_JSON_ARRAY          0       /* JSON array, from a list or tuple */
+#define PEB_JSON_OBJECT         1       /* JSON object, from a map */
+#define PEB_JSON_PROPLIST       2       /* JSON object, from [{Key, Value}] */
+
+#ifndef ERL_V4_PORT_EXT
+#define ERL_V4_PORT_EXT         'x'
+#endif
+
+#define PEB_STACK_INITIAL       4096    /* Initial size of the codec stack, in bytes */
+
+#define PEB_FMT_REPEAT          0x01    /* [~x*], {~x*}: the body encodes every element */
+#define PEB_FMT_KEY_ATOM        0x02    /* #{~a=>~x*}: how the keys of a repeated map are written */
+#define PEB_FMT_KEY_STRING      0x04
+#define PEB_FMT_KEY_BINARY      0x08
+#define PEB_FMT_KEY_LONG        0x10
+#define PEB_FMT_KEY_MASK        0x1e
+#define PEB_FMT_KEY_AUTO        0x20    /* #{~x*}: keys follow the PHP array */
+#define PEB_FMT_KEY_PAIR        0x40    /* [~a=>~x*]: a proplist, every key and value in a tuple */
+
+typedef struct _peb_fmt_op {
+    unsigned char   code;
+    unsigned char   flags;
+    uint32_t        arg;                /* repeated containers: index of the closing op */
+} peb_fmt_op;
+
+typedef struct _peb_fmt_prog {
+    uint32_t        len;
+    uint32_t        depth;              /* max tuple/list nesting */
+    peb_fmt_op      ops[1];
+} peb_fmt_prog;
+
+typedef struct _peb_enc_frame {
+    HashTable*      arr;                /* enclosing data array and cursor */
+    zend_long       idx;
+    int             hdr;                /* offset of the reserved header */
+    uint32_t        count;              /* elements written so far */
+    int             repeat;             /* walking the array with pos */
+    int             keys;               /* repeated map, write the key of every element */
+    HashPosition    pos;
+} peb_enc_frame;
+
+typedef struct _peb_dec_frame {
+    zval            arr;                /* tuple, list or map being filled */
+    int             remaining;          /* elements left in the current chunk */
+    int             is_list;
+    int             is_map;
+    int             has_key;            /* map key decoded, waiting for its value */
+    int             is_proplist;        /* a list of {Key, Value} filled like a map */
+    int             start;              /* proplist header, decoded again as a list on a non-pair */
+    zend_string*    key;                /* NULL for integer keys */
+    zend_ulong      idx;
+} peb_dec_frame;
+
+typedef struct _peb_term_object {
+    zval            msg;                /* term resource owning the buffer */
+    int             offset;             /* tuple or list header */
+    int             is_list;
+    uint32_t        arity;              /* tuple arity */
+    int*            index;              /* offsets of the elements indexed so far */
+    uint32_t        count;
+    uint32_t        size;
+    int             next;               /* offset of the next element to index */
+    uint32_t        remaining;          /* elements left in the current list chunk */
+    int             complete;           /* every element is indexed */
+    zend_object     std;
+} peb_term_object;
+
+typedef struct _peb_term_iterator {
+    zend_object_iterator    intern;
+    uint32_t                pos;
+    zval                    current;
+} peb_term_iterator;
+
+typedef struct _peb_list_object {
+    zval            msg;                /* term resource owning the buffer */
+    int             offset;             /* list header */
+    int             next;               /* offset of the next element */
+    uint32_t        remaining;          /* elements left in the current list chunk */
+    zend_long       pos;
+    zval            current;            /* the only decoded element, UNDEF past the end */
+    int             failed;             /* decoding stopped on a bad element or tail */
+    zend_object     std;
+} peb_list_object;
+
+typedef struct _peb_atom {
+    zend_string*    name;               /* persistent, flagged interned so requests never free it */
+    uint32_t        len;                /* length of ext */
+    char            ext[1];             /* the atom as written by _peb_x_put_atom() */
+} peb_atom;
+
+typedef struct _peb_schema_field {
+    zend_string*            name;       /* property name */
+    zend_string*            ref;        /* schema name of @name */
+    zend_property_info*     info;       /* property, resolved per request */
+    unsigned char           type;
+    unsigned char           is_list;
+    unsigned char           nullable;
+} peb_schema_field;
+
+typedef struct _peb_schema {
+    zend_string*            class_name;
+    zend_string*            spec;
+    zend_string*            tag;        /* record tag, or NULL */
+    zend_class_entry*       ce;         /* class, resolved per request */
+    zend_ulong              gen;        /* request the class was resolved in */
+    uint32_t                count;
+    peb_schema_field        fields[1];
+} peb_schema;
+
+typedef struct _peb_json_frame {
+    uint32_t    remaining;      /* elements left, term to JSON */
+    uint32_t    count;          /* elements so far */
+    int         kind;
+    int         is_list;
+    int         is_tuple;
+    int         hdr;            /* header offset, JSON to term */
+    int         value_at;       /* offset of the "tuple" value, or -1 */
+} peb_json_frame;
+
+typedef struct _peb_val_frame {
+    HashTable*      ht;
+    HashPosition    pos;
+    int             is_map;
+    int             is_proplist;        /* the map is written as [{Key, Value}] */
+} peb_val_frame;
+
 /*
  * Every user visible function must have an entry in peb_functions[].
  */
@@ -64,15 +330,40 @@ static const zend_function_entry peb_functions[] = {
   PHP_FE(peb_connect, NULL)
   PHP_FE(peb_pconnect, NULL)
   PHP_FE(peb_close, NULL)
+  PHP_FE(peb_set_deadline, NULL)
+  PHP_FE(peb_pool_acquire, NULL)
+  PHP_FE(peb_pool_release, NULL)
   PHP_FE(peb_send_byname, NULL)
   PHP_FE(peb_send_bypid, NULL)
+  PHP_FE(peb_send_many, NULL)
   PHP_FE(peb_rpc, NULL) 
   PHP_FE(peb_rpc_to, NULL)
+  PHP_FE(peb_rpc_async, NULL)
+  PHP_FE(peb_await, NULL)
+  PHP_FE(peb_await_all, NULL)
   PHP_FE(peb_receive, NULL)
+  PHP_FE(peb_send_raw, NULL)
+  PHP_FE(peb_receive_raw, NULL)
   PHP_FE(peb_vencode, NULL)
   PHP_FE(peb_encode, NULL)
+  PHP_FE(peb_vencode_value, NULL)
+  PHP_FE(peb_encode_value, NULL)
   PHP_FE(peb_decode, NULL)
   PHP_FE(peb_vdecode, NULL)
+  PHP_FE(peb_decode_lazy, NULL)
+  PHP_FE(peb_vdecode_lazy, NULL)
+  PHP_FE(peb_term_get, NULL)
+  PHP_FE(peb_term_get_many, NULL)
+  PHP_FE(peb_term_to_string, NULL)
+  PHP_FE(peb_string_to_term, NULL)
+  PHP_FE(peb_decode_iter, NULL)
+  PHP_FE(peb_decode_columns, NULL)
+  PHP_FE(peb_pack_vector, NULL)
+  PHP_FE(peb_unpack_vector, NULL)
+  PHP_FE(peb_term_to_json, NULL)
+  PHP_FE(peb_json_to_term, NULL)
+  PHP_FE(peb_register_schema, NULL)
+  PHP_FE(peb_decode_as, NULL)
   PHP_FE(peb_error, NULL)
   PHP_FE(peb_errorno, NULL)
   PHP_FE(peb_linkinfo, NULL)
@@ -81,6 +372,105 @@ static const zend_function_entry peb_functions[] = {
   PHP_FE_END
 };
 
+/*
+ * PebTerm methods
+ */
+#if PHP_VERSION_ID >= 80000
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(arginfo_peb_term_offsetget, 0, 1, IS_MIXED, 0)
+#else
+ZEND_BEGIN_ARG_INFO_EX(arginfo_peb_term_offsetget, 0, 0, 1)
+#endif
+  ZEND_ARG_INFO(0, offset)
+ZEND_END_ARG_INFO()
+
+#if PHP_VERSION_ID >= 80000
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(arginfo_peb_term_offsetexists, 0, 1, _IS_BOOL, 0)
+#else
+ZEND_BEGIN_ARG_INFO_EX(arginfo_peb_term_offsetexists, 0, 0, 1)
+#endif
+  ZEND_ARG_INFO(0, offset)
+ZEND_END_ARG_INFO()
+
+#if PHP_VERSION_ID >= 80000
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(arginfo_peb_term_offsetset, 0, 2, IS_VOID, 0)
+#else
+ZEND_BEGIN_ARG_INFO_EX(arginfo_peb_term_offsetset, 0, 0, 2)
+#endif
+  ZEND_ARG_INFO(0, offset)
+  ZEND_ARG_INFO(0, value)
+ZEND_END_ARG_INFO()
+
+#if PHP_VERSION_ID >= 80000
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(arginfo_peb_term_offsetunset, 0, 1, IS_VOID, 0)
+#else
+ZEND_BEGIN_ARG_INFO_EX(arginfo_peb_term_offsetunset, 0, 0, 1)
+#endif
+  ZEND_ARG_INFO(0, offset)
+ZEND_END_ARG_INFO()
+
+#if PHP_VERSION_ID >= 80000
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(arginfo_peb_term_count, 0, 0, IS_LONG, 0)
+#else
+ZEND_BEGIN_ARG_INFO_EX(arginfo_peb_term_count, 0, 0, 0)
+#endif
+ZEND_END_ARG_INFO()
+
+#if PHP_VERSION_ID >= 80000
+ZEND_BEGIN_ARG_WITH_RETURN_OBJ_INFO_EX(arginfo_peb_term_getiterator, 0, 0, Iterator, 0)
+#else
+ZEND_BEGIN_ARG_INFO_EX(arginfo_peb_term_getiterator, 0, 0, 0)
+#endif
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_peb_term_void, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+static const zend_function_entry peb_term_methods[] = {
+  PHP_ME(PebTerm, __construct, arginfo_peb_term_void, ZEND_ACC_PRIVATE)
+  PHP_ME(PebTerm, offsetGet, arginfo_peb_term_offsetget, ZEND_ACC_PUBLIC)
+  PHP_ME(PebTerm, offsetExists, arginfo_peb_term_offsetexists, ZEND_ACC_PUBLIC)
+  PHP_ME(PebTerm, offsetSet, arginfo_peb_term_offsetset, ZEND_ACC_PUBLIC)
+  PHP_ME(PebTerm, offsetUnset, arginfo_peb_term_offsetunset, ZEND_ACC_PUBLIC)
+  PHP_ME(PebTerm, count, arginfo_peb_term_count, ZEND_ACC_PUBLIC)
+  PHP_ME(PebTerm, getIterator, arginfo_peb_term_getiterator, ZEND_ACC_PUBLIC)
+  PHP_ME(PebTerm, toArray, arginfo_peb_term_void, ZEND_ACC_PUBLIC)
+  PHP_FE_END
+};
+
+/*
+ * PebListIterator methods
+ */
+#if PHP_VERSION_ID >= 80000
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(arginfo_peb_list_mixed, 0, 0, IS_MIXED, 0)
+#else
+ZEND_BEGIN_ARG_INFO_EX(arginfo_peb_list_mixed, 0, 0, 0)
+#endif
+ZEND_END_ARG_INFO()
+
+#if PHP_VERSION_ID >= 80000
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(arginfo_peb_list_void, 0, 0, IS_VOID, 0)
+#else
+ZEND_BEGIN_ARG_INFO_EX(arginfo_peb_list_void, 0, 0, 0)
+#endif
+ZEND_END_ARG_INFO()
+
+#if PHP_VERSION_ID >= 80000
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(arginfo_peb_list_valid, 0, 0, _IS_BOOL, 0)
+#else
+ZEND_BEGIN_ARG_INFO_EX(arginfo_peb_list_valid, 0, 0, 0)
+#endif
+ZEND_END_ARG_INFO()
+
+static const zend_function_entry peb_list_methods[] = {
+  PHP_ME(PebListIterator, __construct, arginfo_peb_term_void, ZEND_ACC_PRIVATE)
+  PHP_ME(PebListIterator, current, arginfo_peb_list_mixed, ZEND_ACC_PUBLIC)
+  PHP_ME(PebListIterator, key, arginfo_peb_list_mixed, ZEND_ACC_PUBLIC)
+  PHP_ME(PebListIterator, next, arginfo_peb_list_void, ZEND_ACC_PUBLIC)
+  PHP_ME(PebListIterator, rewind, arginfo_peb_list_void, ZEND_ACC_PUBLIC)
+  PHP_ME(PebListIterator, valid, arginfo_peb_list_valid, ZEND_ACC_PUBLIC)
+  PHP_FE_END
+};
+
 /*
  * peb_module_entry
  */
@@ -108,11 +498,16 @@ ZEND_GET_MODULE(peb)
 /*
  * PHP_INI
  */
-/*PHP_INI_BEGIN()
-    STD_PHP_INI_ENTRY("peb.default_nodename", "server@localhost", PHP_INI_ALL, NULL)
+PHP_INI_BEGIN()
+    /*STD_PHP_INI_ENTRY("peb.default_nodename", "server@localhost", PHP_INI_ALL, NULL)
     STD_PHP_INI_ENTRY("peb.default_cookie", "COOKIE", PHP_INI_ALL, NULL)
-    STD_PHP_INI_ENTRY("peb.default_timeout", "5000", PHP_INI_ALL, NULL)
-PHP_INI_END()*/
+    STD_PHP_INI_ENTRY("peb.default_timeout", "5000", PHP_INI_ALL, NULL)*/
+    STD_PHP_INI_ENTRY("peb.max_depth", "512", PHP_INI_ALL, OnUpdateLong, max_depth, zend_peb_globals, peb_globals)
+    STD_PHP_INI_ENTRY("peb.pool_min", "1", PHP_INI_ALL, OnUpdateLong, pool_min, zend_peb_globals, peb_globals)
+    STD_PHP_INI_ENTRY("peb.pool_max", "4", PHP_INI_ALL, OnUpdateLong, pool_max, zend_peb_globals, peb_globals)
+    STD_PHP_INI_ENTRY("peb.link_max_idle", "60", PHP_INI_ALL, OnUpdateLong, link_max_idle, zend_peb_globals, peb_globals)
+    STD_PHP_INI_ENTRY("peb.request_timeout", "0", PHP_INI_ALL, OnUpdateLong, request_timeout, zend_peb_globals, peb_globals)
+PHP_INI_END()
 
 /*
  * PHP_MINIT_FUNCTION
@@ -138,21 +533,47 @@ static ZEND_RSRC_DTOR_FUNC(le_serverpid_dtor)
     }
 }
 
+static ZEND_RSRC_DTOR_FUNC(le_rpc_dtor)
+{
+    if ( res->ptr ) {
+        peb_rpc_handle* h = res->ptr;
+
+        if ( h->state == PEB_RPC_PENDING ) {
+            zend_hash_index_del(&PEB_G(rpc_pending), h->seq);
+        }
+        else if ( h->state == PEB_RPC_DONE ) {
+            ei_x_free(&h->reply);
+        }
+        zend_list_delete(h->link_res);
+        efree(h);
+        res->ptr = NULL;
+    }
+}
+
+static void _peb_link_free(peb_link* link)
+{
+    int         p = link->is_persistent;
+
+    pefree(link->ec, p);
+    pefree(link->node, p);
+    pefree(link->secret, p);
+    if ( link->fd >= 0 ) {
+        close(link->fd);
+    }
+    pefree(link, p);
+}
+
 static ZEND_RSRC_DTOR_FUNC(le_link_dtor)
 {
     if ( res->ptr ) {
         peb_link*   tmp = (peb_link *) res->ptr;
         int         p = tmp->is_persistent;
 
-        pefree(tmp->ec, p);
-        efree(tmp->node);
-        efree(tmp->secret);
 #if DEBUG_PRINTF
         php_printf("ZEND_RSRC_DTOR_FUNC called\r\n");
 #endif /* DEBUG_PRINTF */
 
-        close(tmp->fd);
-        pefree(tmp, p);
+        _peb_link_free(tmp);
 
         if ( p ) {
             PEB_G(num_persistent)--;
@@ -165,11 +586,168 @@ static ZEND_RSRC_DTOR_FUNC(le_link_dtor)
     }
 }
 
+static void _peb_pool_dtor(zval* zv)
+{
+    peb_pool*   pool = Z_PTR_P(zv);
+    uint32_t    i;
+
+    for ( i = 0; i < pool->count; i++ ) {
+        _peb_link_free(pool->links[i]);
+    }
+    pefree(pool, 1);
+}
+
+static void _peb_fmt_prog_dtor(zval* zv)
+{
+    pefree(Z_PTR_P(zv), 1);
+}
+
+/*
+ * Atom table. Every atom seen by a worker is kept once, as an interned
+ * name handed out to decoded terms without copying and as the bytes the
+ * encoder writes for it, up to PEB_ATOM_CACHE_SIZE atoms.
+ */
+/*
+ * Length of the valid UTF-8 sequence at p, 0 when it is not valid
+ */
+static zend_always_inline int _peb_utf8_len(const unsigned char* p, size_t n)
+{
+    unsigned char   c = p[0];
+
+    if ( c < 0x80 ) {
+        return 1;
+    }
+    if ( c >= 0xc2 && c <= 0xdf ) {
+        return n >= 2 && (p[1] & 0xc0) == 0x80 ? 2 : 0;
+    }
+    if ( c >= 0xe0 && c <= 0xef ) {
+        if ( n < 3 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80 ||
+                (c == 0xe0 && p[1] < 0xa0) || (c == 0xed && p[1] >= 0xa0) ) {
+            /* Overlong forms and surrogates */
+            return 0;
+        }
+        return 3;
+    }
+    if ( c >= 0xf0 && c <= 0xf4 ) {
+        if ( n < 4 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80 || (p[3] & 0xc0) != 0x80 ||
+                (c == 0xf0 && p[1] < 0x90) || (c == 0xf4 && p[1] >= 0x90) ) {
+            return 0;
+        }
+        return 4;
+    }
+
+    return 0;
+}
+
+/*
+ * Atom names are UTF-8. A name that is not valid UTF-8 is taken as Latin-1,
+ * as all names were before atoms were decoded to UTF-8. Returns the length
+ * of the name as written, -1 when it is longer than the 255 characters
+ * Erlang allows.
+ */
+static int _peb_atom_utf8_len(const char* p, size_t len, int* latin1)
+{
+    const unsigned char*    s = (const unsigned char*) p;
+    size_t                  i = 0, chars = 0, ulen = len;
+    int                     n;
+
+    while ( i < len && (n=_peb_utf8_len(s + i, len - i)) > 0 ) {
+        i += n;
+        chars++;
+    }
+
+    *latin1 = i < len;
+    if ( *latin1 ) {
+        for ( chars = len, i = 0; i < len; i++ ) {
+            ulen += s[i] >> 7;
+        }
+    }
+
+    return chars > 255 ? -1 : (int) ulen;
+}
+
+/*
+ * Writes the atom as a UTF-8 atom at s, ulen from _peb_atom_utf8_len()
+ */
+static char* _peb_atom_write(char* s, const char* p, size_t len, int ulen, int latin1)
+{
+    size_t      i;
+
+    if ( ulen <= 255 ) {
+        *s++ = ERL_SMALL_ATOM_UTF8_EXT;
+        *s++ = (char) ulen;
+    }
+    else {
+        *s++ = ERL_ATOM_UTF8_EXT;
+        *s++ = (char) (ulen >> 8);
+        *s++ = (char) ulen;
+    }
+
+    if ( !latin1 ) {
+        memcpy(s, p, len);
+        return s + len;
+    }
+
+    for ( i = 0; i < len; i++ ) {
+        unsigned char c = p[i];
+
+        if ( c < 0x80 ) {
+            *s++ = c;
+        }
+        else {
+            *s++ = 0xc0 | (c >> 6);
+            *s++ = 0x80 | (c & 0x3f);
+        }
+    }
+
+    return s;
+}
+
+static void _peb_atom_dtor(zval* zv)
+{
+    peb_atom*   atom = Z_PTR_P(zv);
+
+    pefree(atom->name, 1);
+    pefree(atom, 1);
+}
+
+static peb_atom* _peb_atom_get(const char* p, size_t len)
+{
+    peb_atom*   atom;
+    int         ulen, latin1;
+
+    if ( (atom=zend_hash_str_find_ptr(&PEB_G(atom_cache), p, len)) != NULL ) {
+        return atom;
+    }
+
+    if ( (ulen=_peb_atom_utf8_len(p, len, &latin1)) < 0 ||
+            zend_hash_num_elements(&PEB_G(atom_cache)) >= PEB_ATOM_CACHE_SIZE ) {
+        return NULL;
+    }
+
+    atom = pemalloc(sizeof(peb_atom) + ulen + 3, 1);
+    atom->len = _peb_atom_write(atom->ext, p, len, ulen, latin1) - atom->ext;
+
+    atom->name = zend_string_init(p, len, 1);
+    zend_string_hash_val(atom->name);
+#if PHP_VERSION_ID >= 70300
+    GC_ADD_FLAGS(atom->name, IS_STR_INTERNED | IS_STR_PERMANENT);
+#else
+    GC_FLAGS(atom->name) |= IS_STR_INTERNED | IS_STR_PERMANENT;
+#endif
+
+    zend_hash_str_add_ptr(&PEB_G(atom_cache), p, len, atom);
+
+    return atom;
+}
+
 /*
  * Module initialisation function
  */
 PHP_MINIT_FUNCTION(peb)
 {
+    zend_class_entry    ce;
+
     PEB_G(default_link) = NULL;
     PEB_G(num_link) = 0;
     PEB_G(num_persistent) = 0;
@@ -178,13 +756,78 @@ PHP_MINIT_FUNCTION(peb)
 
     PEB_G(instanceid) = 0;
 
+    zend_hash_init(&PEB_G(fmt_cache), 32, NULL, _peb_fmt_prog_dtor, 1);
+    zend_hash_init(&PEB_G(atom_cache), 64, NULL, _peb_atom_dtor, 1);
+    zend_hash_init(&PEB_G(atom_wire), 64, NULL, NULL, 1);
+    zend_hash_init(&PEB_G(schemas), 8, NULL, _peb_schema_dtor, 1);
+    PEB_G(schema_gen) = 0;
+    zend_hash_init(&PEB_G(pools), 8, NULL, _peb_pool_dtor, 1);
+    PEB_G(pool_seq) = 0;
+
+    /* Replies are mostly tagged with these */
+    _peb_atom_get("ok", sizeof("ok") - 1);
+    _peb_atom_get("error", sizeof("error") - 1);
+    _peb_atom_get("true", sizeof("true") - 1);
+    _peb_atom_get("false", sizeof("false") - 1);
+    _peb_atom_get("undefined", sizeof("undefined") - 1);
+    _peb_atom_get("badrpc", sizeof("badrpc") - 1);
+    _peb_atom_get("EXIT", sizeof("EXIT") - 1);
+    PEB_G(stack) = NULL;
+    PEB_G(stack_size) = 0;
+
     le_link = zend_register_list_destructors_ex(le_link_dtor,NULL,PEB_RESOURCENAME,module_number);
     le_plink = zend_register_list_destructors_ex(NULL,le_link_dtor,PEB_RESOURCENAME,module_number);
 
     le_msgbuff = zend_register_list_destructors_ex(le_msgbuff_dtor,NULL,PEB_TERMRESOURCE,module_number);
     le_serverpid = zend_register_list_destructors_ex(le_serverpid_dtor,NULL,PEB_SERVERPID,module_number);
+    le_rpc = zend_register_list_destructors_ex(le_rpc_dtor,NULL,PEB_RPCRESOURCE,module_number);
+
+    INIT_CLASS_ENTRY(ce, "PebTerm", peb_term_methods);
+    peb_term_ce = zend_register_internal_class(&ce);
+    peb_term_ce->ce_flags |= ZEND_ACC_FINAL;
+#ifdef ZEND_ACC_NOT_SERIALIZABLE
+    peb_term_ce->ce_flags |= ZEND_ACC_NOT_SERIALIZABLE;
+#else
+    peb_term_ce->serialize = zend_class_serialize_deny;
+    peb_term_ce->unserialize = zend_class_unserialize_deny;
+#endif
+    peb_term_ce->create_object = peb_term_create;
+    peb_term_ce->get_iterator = peb_term_get_iterator;
+    zend_class_implements(peb_term_ce, 3, zend_ce_arrayaccess, zend_ce_countable, zend_ce_aggregate);
+
+    memcpy(&peb_term_handlers, &std_object_handlers, sizeof(zend_object_handlers));
+    peb_term_handlers.offset = XtOffsetOf(peb_term_object, std);
+    peb_term_handlers.free_obj = peb_term_free;
+    peb_term_handlers.clone_obj = NULL;
+
+    INIT_CLASS_ENTRY(ce, "PebListIterator", peb_list_methods);
+    peb_list_ce = zend_register_internal_class(&ce);
+    peb_list_ce->ce_flags |= ZEND_ACC_FINAL;
+#ifdef ZEND_ACC_NOT_SERIALIZABLE
+    peb_list_ce->ce_flags |= ZEND_ACC_NOT_SERIALIZABLE;
+#else
+    peb_list_ce->serialize = zend_class_serialize_deny;
+    peb_list_ce->unserialize = zend_class_unserialize_deny;
+#endif
+    peb_list_ce->create_object = peb_list_create;
+    peb_list_ce->get_iterator = peb_list_get_iterator;
+    zend_class_implements(peb_list_ce, 1, zend_ce_iterator);
+
+    memcpy(&peb_list_handlers, &std_object_handlers, sizeof(zend_object_handlers));
+    peb_list_handlers.offset = XtOffsetOf(peb_list_object, std);
+    peb_list_handlers.free_obj = peb_list_free;
+    peb_list_handlers.clone_obj = NULL;
         
-    /*REGISTER_INI_ENTRIES();*/
+    REGISTER_LONG_CONSTANT("PEB_PROPLISTS", PEB_OPT_PROPLISTS, CONST_CS | CONST_PERSISTENT);
+    REGISTER_LONG_CONSTANT("PEB_ATOM_KEYS", PEB_OPT_ATOM_KEYS, CONST_CS | CONST_PERSISTENT);
+    REGISTER_LONG_CONSTANT("PEB_CHARLISTS", PEB_OPT_CHARLISTS, CONST_CS | CONST_PERSISTENT);
+    REGISTER_LONG_CONSTANT("PEB_JSON_PLAIN_ATOMS", PEB_OPT_JSON_PLAIN_ATOMS, CONST_CS | CONST_PERSISTENT);
+    REGISTER_LONG_CONSTANT("PEB_JSON_BASE64", PEB_OPT_JSON_BASE64, CONST_CS | CONST_PERSISTENT);
+    REGISTER_LONG_CONSTANT("PEB_JSON_TUPLES", PEB_OPT_JSON_TUPLES, CONST_CS | CONST_PERSISTENT);
+    REGISTER_LONG_CONSTANT("PEB_POOL_LEAST_LOADED", PEB_POOL_LEAST_LOADED, CONST_CS | CONST_PERSISTENT);
+    REGISTER_LONG_CONSTANT("PEB_POOL_ROUND_ROBIN", PEB_POOL_ROUND_ROBIN, CONST_CS | CONST_PERSISTENT);
+
+    REGISTER_INI_ENTRIES();
     return SUCCESS;
 }
 
@@ -193,13 +836,23 @@ PHP_MINIT_FUNCTION(peb)
  */
 PHP_MSHUTDOWN_FUNCTION(peb)
 {
-    /*UNREGISTER_INI_ENTRIES();*/
+    UNREGISTER_INI_ENTRIES();
 
     /* release all link resource here */
     if ( PEB_G(error) != NULL ) {
         efree(PEB_G(error));
     }
 
+    zend_hash_destroy(&PEB_G(fmt_cache));
+    zend_hash_destroy(&PEB_G(atom_wire));
+    zend_hash_destroy(&PEB_G(atom_cache));
+    zend_hash_destroy(&PEB_G(schemas));
+    zend_hash_destroy(&PEB_G(pools));
+
+    if ( PEB_G(stack) != NULL ) {
+        pefree(PEB_G(stack), 1);
+    }
+
     return SUCCESS;
 }
 
@@ -213,6 +866,13 @@ PHP_RINIT_FUNCTION(peb)
     PEB_G(error) = NULL;
     PEB_G(errorno) = 0;
 
+    /* Schemas resolve their classes again, which may differ per request */
+    PEB_G(schema_gen)++;
+
+    zend_hash_init(&PEB_G(rpc_pending), 8, NULL, NULL, 0);
+
+    PEB_G(deadline) = PEB_G(request_timeout) > 0 ? _peb_now_ms() + PEB_G(request_timeout) : 0;
+
     return SUCCESS;
 }
 
@@ -221,6 +881,23 @@ PHP_RINIT_FUNCTION(peb)
  */
 PHP_RSHUTDOWN_FUNCTION(peb)
 {
+    peb_pool*       pool;
+    peb_rpc_handle* h;
+    uint32_t        i;
+
+    /* Links still checked out are given back with the request */
+    ZEND_HASH_FOREACH_PTR(&PEB_G(pools), pool) {
+        for ( i = 0; i < pool->count; i++ ) {
+            pool->links[i]->in_use = 0;
+        }
+    } ZEND_HASH_FOREACH_END();
+
+    /* Handles still waiting are freed after this, they must not look here */
+    ZEND_HASH_FOREACH_PTR(&PEB_G(rpc_pending), h) {
+        h->state = PEB_RPC_FAILED;
+    } ZEND_HASH_FOREACH_END();
+    zend_hash_destroy(&PEB_G(rpc_pending));
+
     if ( PEB_G(error) != NULL ) {
         efree(PEB_G(error));
     }
@@ -238,7 +915,7 @@ PHP_MINFO_FUNCTION(peb)
     php_info_print_table_row(2, "version", PHP_PEB_VERSION);
     php_info_print_table_end();
 
-    /*DISPLAY_INI_ENTRIES();*/
+    DISPLAY_INI_ENTRIES();
 }
 
 /*
@@ -314,129 +991,366 @@ PHP_FUNCTION(peb_linkinfo)
 }
 
 /*
- * Connect to Erlang node
+ * Deadlines are absolute times in milliseconds on the monotonic clock, 0
+ * for none. A blocking call runs until the earlier of its own timeout and
+ * the request deadline, see peb.request_timeout and peb_set_deadline(),
+ * and the time left is worked out again after every tick and retry.
  */
-static void php_peb_connect_impl(INTERNAL_FUNCTION_PARAMETERS, int persistent)
+static zend_long _peb_now_ms(void)
 {
-    char        *node = NULL, *secret = NULL;
-    char        *thisnode = NULL/*, *key = NULL*/;
-    int         node_len, secret_len, this_len/*, key_len*/;
-    int         instance;
+    struct timespec ts;
 
-    zend_long   tmo = 0;
-    smart_str   key = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    peb_link*   alink = NULL;
-    ei_cnode*   ec = NULL;
+    return (zend_long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "ss|l", &node, &node_len,
-            &secret, &secret_len, &tmo) == FAILURE ) {
-        RETURN_FALSE;
+static zend_long _peb_deadline(zend_long tmo)
+{
+    zend_long   deadline = tmo > 0 ? _peb_now_ms() + tmo : 0;
+
+    if ( PEB_G(deadline) > 0 && (deadline == 0 || PEB_G(deadline) < deadline) ) {
+        deadline = PEB_G(deadline);
     }
 
-#if DEBUG_PRINTF
-    php_printf("PEB: php_peb_connect_impl(): connecting to erlang node: %s, timeout: %d\n", node, tmo);
-#endif /* DEBUG_PRINTF */
+    return deadline;
+}
 
-    /*key_len = spprintf(&key, 0, "peb_%s_%s", node, secret);*/
-    smart_str_appends(&key, "peb_");
-    smart_str_appendl(&key, node, node_len);
-    smart_str_appendc(&key, '_');
-    smart_str_appendl(&key, secret, secret_len);
-    smart_str_0(&key);
+static void _peb_timed_out(zend_long deadline)
+{
+    if ( deadline == PEB_G(deadline) ) {
+        PEB_G(errorno) = PEB_ERRORNO_DEADLINE;
+        PEB_G(error) = estrdup(PEB_ERROR_DEADLINE);
+    }
+    else {
+        PEB_G(errorno) = PEB_ERRORNO_TIMEOUT;
+        PEB_G(error) = estrdup(PEB_ERROR_TIMEOUT);
+    }
+}
 
-    if ( persistent ) {
-        zend_resource*  le;
+/*
+ * Milliseconds left until deadline, as the ei timeouts take them with 0
+ * for no limit. Returns -1 and reports it once the deadline has passed.
+ */
+static zend_long _peb_remaining(zend_long deadline)
+{
+    zend_long   left;
 
-        if ( (le = zend_hash_find_ptr(&EG(persistent_list), key.s)) != NULL ) {
-            if ( le->type == le_plink ) {
-                alink = (peb_link *) le->ptr;
+    if ( deadline == 0 ) {
+        return 0;
+    }
+    if ( (left=deadline - _peb_now_ms()) > 0 ) {
+        return left;
+    }
 
+    _peb_timed_out(deadline);
+    return -1;
+}
 
-                RETVAL_RES(zend_register_resource(alink, le_plink));
-                PEB_G(default_link) = Z_RES_VAL_P(return_value);
-                smart_str_free(&key);
-#if DEBUG_PRINTF
-                php_printf("PEB: php_peb_connect_impl(): found an existing persistent link\r\n");
-#endif /* DEBUG_PRINTF */
-                return;
-            }
-            else {
-                php_error(E_WARNING, "PEB: php_peb_connect_impl(): Hash key confilict! "
-                                    "Given name associate with non-peb resource!\r\n");
-                smart_str_free(&key);
-                RETURN_FALSE;
-            }
-        }
+/*
+ * Sets the error of a failed ei call unless one is set already, a call
+ * that ran out of time is reported as a timeout
+ */
+static void _peb_fail(zend_long deadline, int errorno, const char* error)
+{
+    if ( PEB_G(errorno) != 0 ) {
+        return;
     }
 
-    ec = pemalloc(sizeof(ei_cnode), persistent);
-    if ( persistent ) {
-        instance = 0;
-        this_len = spprintf(&thisnode, 0, "peb_client_%d_%d", getpid(), instance);
+    if ( deadline > 0 && erl_errno == ETIMEDOUT ) {
+        _peb_timed_out(deadline);
     }
     else {
-        instance = PEB_G(instanceid)++;
-        this_len = spprintf(&thisnode, 0, "peb_client_%d", getpid());
+        PEB_G(errorno) = errorno;
+        PEB_G(error) = estrdup(error);
+    }
+}
+
+/*
+ * Connect to Erlang node
+ */
+/*
+ * Opens a link to node as the C node thisnode, errors are left in
+ * peb_error(). Persistent links are allocated to outlive the request.
+ */
+static peb_link* _peb_link_open(const char* node, size_t node_len, const char* secret, size_t secret_len,
+        char* thisnode, int instance, zend_long tmo, int persistent)
+{
+    peb_link*   alink;
+    ei_cnode*   ec;
+    zend_long   left;
+    int         fd;
+
+    if ( (left=_peb_remaining(_peb_deadline(tmo))) < 0 ) {
+        return NULL;
     }
 
-    if ( ei_connect_init(ec, thisnode, secret, instance) < 0 ) {
+    ec = pemalloc(sizeof(ei_cnode), persistent);
+
+    if ( ei_connect_init(ec, thisnode, (char*) secret, instance) < 0 ) {
 #if DEBUG_PRINTF
-        php_error(E_WARNING, "PEB: php_peb_connect_impl(): connect init failure\r\n");
+        php_error(E_WARNING, "PEB: _peb_link_open(): connect init failure\r\n");
 #endif /* DEBUG_PRINTF */
         PEB_G(errorno) = PEB_ERRORNO_INIT;
         PEB_G(error) = estrdup(PEB_ERROR_INIT);
-        efree(thisnode);
         pefree(ec, persistent);
-        smart_str_free(&key);
-        RETURN_FALSE;
+        return NULL;
     }
 
-    efree(thisnode);
-
-    if ( (fd = ei_connect_tmo(ec, node, tmo)) < 0 ) {
+    if ( (fd = ei_connect_tmo(ec, (char*) node, (unsigned) left)) < 0 ) {
 #if DEBUG_PRINTF
-        php_error(E_WARNING, "PEB: php_peb_connect_impl(): connect error :%d\r\n", fd);
+        php_error(E_WARNING, "PEB: _peb_link_open(): connect error :%d\r\n", fd);
 #endif /* DEBUG_PRINTF */
         PEB_G(errorno) = PEB_ERRORNO_CONN;
         PEB_G(error) = estrdup(PEB_ERROR_CONN);
         pefree(ec, persistent);
-        smart_str_free(&key);
-        RETURN_FALSE;
+        return NULL;
     }
 
     alink = pemalloc(sizeof(peb_link), persistent);
     alink->ec = ec;
-    alink->node = estrndup(node, node_len);
-    alink->secret = estrndup(secret, secret_len);
+    alink->node = pestrndup(node, node_len, persistent);
+    alink->secret = pestrndup(secret, secret_len, persistent);
     alink->fd = fd;
     alink->is_persistent = persistent;
+    alink->tmo = tmo;
+    alink->used = time(NULL);
+    alink->pool = NULL;
+    alink->in_use = 0;
 
-    if ( persistent ) {
-        zend_resource   newle;
+    return alink;
+}
 
-        PEB_G(num_link)++;
-        PEB_G(num_persistent)++;
+/*
+ * Tells whether the peer is still there without blocking: a hang up, a
+ * socket error or a pending EOF mean it is gone. Data waiting to be read,
+ * ticks most of the time, is left in place.
+ */
+static int _peb_link_alive(peb_link* link)
+{
+    struct pollfd   pfd;
+    char            c;
+    ssize_t         n;
 
-        newle.ptr = alink;
-        newle.type = le_plink;
+    if ( link->fd < 0 ) {
+        return 0;
+    }
 
-        zend_hash_update_mem(&EG(persistent_list), key.s, (void*)&newle, sizeof(zend_resource));
-        /* TODO: check result code */
+    pfd.fd = link->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
 
-        RETVAL_RES(zend_register_resource(alink, le_plink));
-        PEB_G(default_link) = Z_RES_VAL_P(return_value);
+    if ( poll(&pfd, 1, 0) < 0 ) {
+        return errno == EINTR;
     }
-    else {
-        PEB_G(num_link)++;
-        RETVAL_RES(zend_register_resource(alink, le_link));
+    if ( pfd.revents & (POLLERR | POLLHUP | POLLNVAL) ) {
+        return 0;
+    }
+    if ( pfd.revents & POLLIN ) {
+        n = recv(link->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if ( n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ) {
+            return 0;
+        }
     }
 
-    smart_str_free(&key);
-
-#if DEBUG_PRINTF
-    php_printf("PEB: php_peb_connect_impl: node %s, connected\r\n", node);
-#endif /* DEBUG_PRINTF */
+    return 1;
+}
+
+/*
+ * Fails every asynchronous call still pending on a link that broke,
+ * their replies will not come over a new connection
+ */
+static void _peb_rpc_fail(peb_link* link)
+{
+    peb_rpc_handle* h;
+
+    ZEND_HASH_FOREACH_PTR(&PEB_G(rpc_pending), h) {
+        if ( h->link == link ) {
+            h->state = PEB_RPC_FAILED;
+            zend_hash_index_del(&PEB_G(rpc_pending), h->seq);
+        }
+    } ZEND_HASH_FOREACH_END();
+}
+
+/*
+ * Closes the socket of a link that can no longer be trusted, the calls
+ * still waiting for a reply on it fail
+ */
+static void _peb_link_drop(peb_link* link)
+{
+    _peb_rpc_fail(link);
+
+    if ( link->fd >= 0 ) {
+        close(link->fd);
+        link->fd = -1;
+    }
+}
+
+/*
+ * Connects the link again with the C node it was opened with, 0 on success.
+ * The connect ends by the deadline of the call it is made for, if earlier
+ * than the connect timeout of the link; past the deadline it is not tried.
+ */
+static int _peb_link_reconnect(peb_link* link, zend_long deadline)
+{
+    zend_long   left, d = _peb_deadline(link->tmo);
+
+    if ( deadline > 0 && (d == 0 || deadline < d) ) {
+        d = deadline;
+    }
+    left = _peb_remaining(d);
+
+    _peb_link_drop(link);
+
+    if ( left < 0 ) {
+        return -1;
+    }
+
+    if ( (link->fd = ei_connect_tmo(link->ec, link->node, (unsigned) left)) < 0 ) {
+#if DEBUG_PRINTF
+        php_error(E_WARNING, "PEB: _peb_link_reconnect(): connect error :%d\r\n", link->fd);
+#endif /* DEBUG_PRINTF */
+        link->fd = -1;
+        return -1;
+    }
+    link->used = time(NULL);
+
+    return 0;
+}
+
+/*
+ * Checks a persistent link before it is handed out again. A link idle for
+ * longer than peb.link_max_idle is not trusted either, the node has most
+ * likely stopped waiting for our ticks by then. Dead links are reconnected,
+ * errors are left in peb_error().
+ */
+static int _peb_link_check(peb_link* link)
+{
+    time_t      now = time(NULL);
+
+    if ( _peb_link_alive(link) &&
+            (PEB_G(link_max_idle) <= 0 || now - link->used <= PEB_G(link_max_idle)) ) {
+        link->used = now;
+        return 0;
+    }
+
+    if ( _peb_link_reconnect(link, 0) < 0 ) {
+        _peb_fail(0, PEB_ERRORNO_CONN, PEB_ERROR_CONN);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Called when a send failed. A persistent link whose peer has gone is
+ * reconnected, returns 1 when the send should be tried once more. Sends
+ * that merely timed out are not repeated, nor is one past the deadline.
+ */
+static int _peb_link_retry(peb_link* link, zend_long deadline)
+{
+    return link->is_persistent && !_peb_link_alive(link) && _peb_link_reconnect(link, deadline) == 0;
+}
+
+static void php_peb_connect_impl(INTERNAL_FUNCTION_PARAMETERS, int persistent)
+{
+    char        *node = NULL, *secret = NULL;
+    char        *thisnode = NULL/*, *key = NULL*/;
+    size_t      node_len, secret_len/*, key_len*/;
+    int         instance;
+
+    zend_long   tmo = 0;
+    smart_str   key = {0};
+
+    peb_link*   alink = NULL;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "ss|l", &node, &node_len,
+            &secret, &secret_len, &tmo) == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+#if DEBUG_PRINTF
+    php_printf("PEB: php_peb_connect_impl(): connecting to erlang node: %s, timeout: %d\n", node, tmo);
+#endif /* DEBUG_PRINTF */
+
+    /*key_len = spprintf(&key, 0, "peb_%s_%s", node, secret);*/
+    smart_str_appends(&key, "peb_");
+    smart_str_appendl(&key, node, node_len);
+    smart_str_appendc(&key, '_');
+    smart_str_appendl(&key, secret, secret_len);
+    smart_str_0(&key);
+
+    if ( persistent ) {
+        zend_resource*  le;
+
+        if ( (le = zend_hash_find_ptr(&EG(persistent_list), key.s)) != NULL ) {
+            if ( le->type == le_plink ) {
+                alink = (peb_link *) le->ptr;
+
+                if ( _peb_link_check(alink) < 0 ) {
+                    smart_str_free(&key);
+                    RETURN_FALSE;
+                }
+
+                RETVAL_RES(zend_register_resource(alink, le_plink));
+                PEB_G(default_link) = Z_RES_VAL_P(return_value);
+                smart_str_free(&key);
+#if DEBUG_PRINTF
+                php_printf("PEB: php_peb_connect_impl(): found an existing persistent link\r\n");
+#endif /* DEBUG_PRINTF */
+                return;
+            }
+            else {
+                php_error(E_WARNING, "PEB: php_peb_connect_impl(): Hash key confilict! "
+                                    "Given name associate with non-peb resource!\r\n");
+                smart_str_free(&key);
+                RETURN_FALSE;
+            }
+        }
+    }
+
+    if ( persistent ) {
+        instance = 0;
+        spprintf(&thisnode, 0, "peb_client_%d_%d", getpid(), instance);
+    }
+    else {
+        instance = PEB_G(instanceid)++;
+        spprintf(&thisnode, 0, "peb_client_%d", getpid());
+    }
+
+    alink = _peb_link_open(node, node_len, secret, secret_len, thisnode, instance, tmo, persistent);
+    efree(thisnode);
+
+    if ( alink == NULL ) {
+        smart_str_free(&key);
+        RETURN_FALSE;
+    }
+
+    if ( persistent ) {
+        zend_resource   newle;
+
+        PEB_G(num_link)++;
+        PEB_G(num_persistent)++;
+
+        newle.ptr = alink;
+        newle.type = le_plink;
+
+        zend_hash_update_mem(&EG(persistent_list), key.s, (void*)&newle, sizeof(zend_resource));
+        /* TODO: check result code */
+
+        RETVAL_RES(zend_register_resource(alink, le_plink));
+        PEB_G(default_link) = Z_RES_VAL_P(return_value);
+    }
+    else {
+        PEB_G(num_link)++;
+        RETVAL_RES(zend_register_resource(alink, le_link));
+    }
+
+    smart_str_free(&key);
+
+#if DEBUG_PRINTF
+    php_printf("PEB: php_peb_connect_impl: node %s, connected\r\n", node);
+#endif /* DEBUG_PRINTF */
 }
 
 /*
@@ -462,7 +1376,8 @@ PHP_FUNCTION(peb_connect)
 }
 
 /*
- * Open a permanent connection to an Erlang node
+ * Open a permanent connection to an Erlang node. An existing link is
+ * checked first and connected again when the node went away meanwhile.
  *
  * Prototype:
  *      linkid peb_connect(string nodename, string cookie [, int timeout])
@@ -483,6 +1398,205 @@ PHP_FUNCTION(peb_pconnect)
     php_peb_connect_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
 }
 
+/*
+ * Sets the deadline of the request, every blocking call after this gives
+ * up when it is reached and peb_errorno() reports PEB_ERRORNO_DEADLINE
+ *
+ * Prototype:
+ *      boolean peb_set_deadline(int timeout)
+ *
+ * Parameters:
+ *      timeout     milliseconds from now, 0 removes the deadline
+ *
+ * Return:
+ *      true        always
+ */
+PHP_FUNCTION(peb_set_deadline)
+{
+    zend_long   tmo;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "l", &tmo) == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    PEB_G(deadline) = tmo > 0 ? _peb_now_ms() + tmo : 0;
+
+    RETURN_TRUE;
+}
+
+/*
+ * Connection pools. A worker keeps a pool of up to peb.pool_max links per
+ * node and cookie, peb.pool_min of them are opened up front. Every link
+ * has its own C node name, so the links of a pool are separate
+ * distribution connections. Checkouts are counted per link and all
+ * returned at the end of the request.
+ */
+static peb_link* _peb_pool_open(peb_pool* pool, const char* node, size_t node_len,
+        const char* secret, size_t secret_len, zend_long tmo)
+{
+    peb_link*   link;
+    char*       thisnode = NULL;
+    int         instance = ++PEB_G(pool_seq);
+
+    spprintf(&thisnode, 0, "peb_pool_%d_%d", getpid(), instance);
+    link = _peb_link_open(node, node_len, secret, secret_len, thisnode, instance, tmo, 1);
+    efree(thisnode);
+
+    if ( link == NULL ) {
+        return NULL;
+    }
+
+    link->pool = pool;
+    pool->links[pool->count++] = link;
+
+    return link;
+}
+
+/*
+ * Picks the link to check out, NULL when a new one should be opened
+ */
+static peb_link* _peb_pool_pick(peb_pool* pool, zend_long strategy)
+{
+    peb_link*   best = NULL;
+    uint32_t    i;
+
+    if ( strategy == PEB_POOL_ROUND_ROBIN ) {
+        i = pool->next++ % pool->max;
+        return i < pool->count ? pool->links[i] : NULL;
+    }
+
+    /* Least loaded, an idle link or a new one before sharing a busy one */
+    for ( i = 0; i < pool->count; i++ ) {
+        if ( best == NULL || pool->links[i]->in_use < best->in_use ) {
+            best = pool->links[i];
+        }
+    }
+    if ( (best == NULL || best->in_use > 0) && pool->count < pool->max ) {
+        return NULL;
+    }
+
+    return best;
+}
+
+/*
+ * Checks a link to an Erlang node out of the worker's pool
+ *
+ * Prototype:
+ *      linkid peb_pool_acquire(string nodename, string cookie [, int timeout [, int strategy]])
+ *
+ * Parameters:
+ *      nodename    erlang node (dns/ip)
+ *      cookie      secret cookie for connecion
+ *      timeout     connect timeout in milliseconds, default is no timeout
+ *      strategy    PEB_POOL_LEAST_LOADED (default) or PEB_POOL_ROUND_ROBIN
+ *
+ * Return:
+ *      linkid      link ident to use with the other peb functions and to
+ *                  give back with peb_pool_release(), false on error
+ */
+PHP_FUNCTION(peb_pool_acquire)
+{
+    char*       node;
+    char*       secret;
+    size_t      node_len, secret_len;
+    zend_long   tmo = 0;
+    zend_long   strategy = PEB_POOL_LEAST_LOADED;
+    zend_long   min, max;
+    smart_str   key = {0};
+    peb_pool*   pool;
+    peb_link*   link;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "ss|ll", &node, &node_len,
+            &secret, &secret_len, &tmo, &strategy) == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    smart_str_appends(&key, "peb_");
+    smart_str_appendl(&key, node, node_len);
+    smart_str_appendc(&key, '_');
+    smart_str_appendl(&key, secret, secret_len);
+    smart_str_0(&key);
+
+    /* The limits are taken when the pool is created */
+    if ( (pool=zend_hash_find_ptr(&PEB_G(pools), key.s)) == NULL ) {
+        max = MAX(PEB_G(pool_max), 1);
+        min = MIN(MAX(PEB_G(pool_min), 0), max);
+
+        pool = pecalloc(1, sizeof(peb_pool) + (max - 1) * sizeof(peb_link*), 1);
+        pool->min = (uint32_t) min;
+        pool->max = (uint32_t) max;
+        zend_hash_str_update_ptr(&PEB_G(pools), ZSTR_VAL(key.s), ZSTR_LEN(key.s), pool);
+    }
+    smart_str_free(&key);
+
+    while ( pool->count < pool->min ) {
+        if ( _peb_pool_open(pool, node, node_len, secret, secret_len, tmo) == NULL ) {
+            RETURN_FALSE;
+        }
+    }
+
+    if ( (link=_peb_pool_pick(pool, strategy)) == NULL ) {
+        if ( (link=_peb_pool_open(pool, node, node_len, secret, secret_len, tmo)) == NULL ) {
+            RETURN_FALSE;
+        }
+    }
+    else if ( _peb_link_check(link) < 0 ) {
+        RETURN_FALSE;
+    }
+
+    link->in_use++;
+    RETVAL_RES(zend_register_resource(link, le_plink));
+}
+
+/*
+ * Gives a link back to its pool, the link identifier can no longer be used
+ *
+ * Prototype:
+ *      boolean peb_pool_release(resource linkid)
+ *
+ * Parameters:
+ *      linkid      link returned by peb_pool_acquire()
+ *
+ * Return:
+ *      true        success
+ *      false       not a checked out link
+ */
+PHP_FUNCTION(peb_pool_release)
+{
+    zval*       peb_linkid;
+    peb_link*   link;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "r", &peb_linkid) == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    if ( (link=(peb_link*)zend_fetch_resource2(Z_RES_P(peb_linkid), PEB_RESOURCENAME, le_link, le_plink)) == NULL ||
+            link->pool == NULL ) {
+        RETURN_FALSE;
+    }
+
+    if ( link->in_use > 0 ) {
+        link->in_use--;
+    }
+    if ( Z_RES_P(peb_linkid) == PEB_G(default_link) ) {
+        PEB_G(default_link) = NULL;
+    }
+
+    /* Persistent links have no request destructor, this only retires the id */
+    zend_list_close(Z_RES_P(peb_linkid));
+
+    RETURN_TRUE;
+}
+
 /*
  * Function closes the non-persistent connection to the Erlang node
  * that's associated with the specified link identifier
@@ -571,7 +1685,7 @@ PHP_FUNCTION(peb_send_byname)
     zend_resource*  linkid;
     zval*           peb_linkid = NULL;
     peb_link*       peb;
-    zend_long       tmo = 0;
+    zend_long       tmo = 0, deadline;
     ei_x_buff*      newbuff;
 
     PEB_G(error) = NULL;
@@ -605,7 +1719,15 @@ PHP_FUNCTION(peb_send_byname)
                     peb->fd, peb->node, process_name, newbuff->buff, tmo);
 #endif /* DEBUG_PRINTF */
 
-    result = ei_reg_send_tmo(peb->ec, peb->fd, process_name, newbuff->buff, newbuff->index, tmo);
+    deadline = _peb_deadline(tmo);
+    if ( (tmo=_peb_remaining(deadline)) < 0 ) {
+        RETURN_FALSE;
+    }
+
+    result = ei_reg_send_tmo(peb->ec, peb->fd, process_name, newbuff->buff, newbuff->index, tmo);
+    if ( result < 0 && _peb_link_retry(peb, deadline) && (tmo=_peb_remaining(deadline)) >= 0 ) {
+        result = ei_reg_send_tmo(peb->ec, peb->fd, process_name, newbuff->buff, newbuff->index, tmo);
+    }
 
     if ( result < 0 ) {
         /* process peb_error here */
@@ -613,8 +1735,7 @@ PHP_FUNCTION(peb_send_byname)
         php_error(E_WARNING, "PEB: peb_send_byname(): failed, result: %d\r\n", result);
 #endif /* DEBUG_PRINTF */
 
-        PEB_G(errorno) = PEB_ERRORNO_SEND;
-        PEB_G(error) = estrdup(PEB_ERROR_SEND);
+        _peb_fail(deadline, PEB_ERRORNO_SEND, PEB_ERROR_SEND);
         RETURN_FALSE;
     }
 
@@ -646,7 +1767,7 @@ PHP_FUNCTION(peb_send_bypid)
     peb_link*       peb;
     zval*           pid = NULL;
     zval*           message = NULL;
-    zend_long       tmo = 0;
+    zend_long       tmo = 0, deadline;
     erlang_pid*     serverpid;
     ei_x_buff*      newbuff;
     int             result;
@@ -681,11 +1802,18 @@ PHP_FUNCTION(peb_send_bypid)
         RETURN_FALSE;
     }
 
+    deadline = _peb_deadline(tmo);
+    if ( (tmo=_peb_remaining(deadline)) < 0 ) {
+        RETURN_FALSE;
+    }
+
     result = ei_send_tmo(peb->fd, serverpid, newbuff->buff, newbuff->index, tmo);
+    if ( result < 0 && _peb_link_retry(peb, deadline) && (tmo=_peb_remaining(deadline)) >= 0 ) {
+        result = ei_send_tmo(peb->fd, serverpid, newbuff->buff, newbuff->index, tmo);
+    }
     if ( result < 0 ) {
         /* process peb_error here */
-        PEB_G(errorno) = PEB_ERRORNO_SEND;
-        PEB_G(error) = estrdup(PEB_ERROR_SEND);
+        _peb_fail(deadline, PEB_ERRORNO_SEND, PEB_ERROR_SEND);
         RETURN_FALSE;
     }
 
@@ -713,7 +1841,7 @@ PHP_FUNCTION(peb_receive)
     zend_resource*  linkid;
     zval*           peb_linkid = NULL;
     peb_link*       peb;
-    zend_long       tmo = 0;
+    zend_long       tmo = 0, deadline;
     ei_x_buff*      newbuff;
     erlang_msg      message;
     int             result;
@@ -741,8 +1869,16 @@ PHP_FUNCTION(peb_receive)
 
     newbuff = emalloc(sizeof(ei_x_buff));
     ei_x_new(newbuff);
+    deadline = _peb_deadline(tmo);
 
     while ( 1 ) {
+        /* A tick does not start the wait over */
+        if ( (tmo=_peb_remaining(deadline)) < 0 ) {
+            ei_x_free(newbuff);
+            efree(newbuff);
+            RETURN_FALSE;
+        }
+
         result = ei_xreceive_msg_tmo(peb->fd, &message, newbuff, tmo);
 
         switch ( result ) {
@@ -766,8 +1902,7 @@ PHP_FUNCTION(peb_receive)
 
             default:
                 /* php_printf("error: unknown ret %d\r\n",ret); */
-                PEB_G(errorno) = PEB_ERRORNO_RECV;
-                PEB_G(error) = estrdup(PEB_ERROR_RECV);
+                _peb_fail(deadline, PEB_ERRORNO_RECV, PEB_ERROR_RECV);
                 ei_x_free(newbuff);
                 efree(newbuff);
                 RETURN_FALSE;
@@ -777,11 +1912,177 @@ PHP_FUNCTION(peb_receive)
     RETURN_TRUE;
 }
 
+/*
+ * Asynchronous RPC. The request goes to rex as a gen_server call, so the
+ * reply comes back as {Ref, Reply} and can be told apart from the replies
+ * of the other calls in flight on the same link. The references are made
+ * up here from a per worker sequence, pending handles are found by it in
+ * PEB_G(rpc_pending). Messages that answer no pending call are dropped.
+ */
+static void _peb_rpc_ref(peb_link* link, zend_ulong seq, erlang_ref* ref)
+{
+    memset(ref, 0, sizeof(erlang_ref));
+    strcpy(ref->node, link->ec->thisnodename);
+    ref->len = 3;
+    ref->n[0] = (unsigned int) (seq & 0x3ffff);
+    ref->n[1] = (unsigned int) (seq >> 18);
+    ref->creation = ei_self(link->ec)->creation;
+}
+
+/*
+ * Reads one message from the link and hands it to the call it answers.
+ * Returns 0 when something was read, ERL_TIMEOUT or ERL_ERROR otherwise.
+ */
+static int _peb_rpc_pump(peb_link* link, zend_long tmo)
+{
+    erlang_msg      msg;
+    erlang_ref      ref;
+    ei_x_buff       x;
+    peb_rpc_handle* h;
+    zend_ulong      seq;
+    int             result, index = 0, version, arity;
+
+    ei_x_new(&x);
+    result = ei_xreceive_msg_tmo(link->fd, &msg, &x, (unsigned) tmo);
+
+    if ( result == ERL_MSG && msg.msgtype == ERL_SEND &&
+            ei_decode_version(x.buff, &index, &version) == 0 &&
+            ei_decode_tuple_header(x.buff, &index, &arity) == 0 && arity == 2 &&
+            ei_decode_ref(x.buff, &index, &ref) == 0 && ref.len == 3 &&
+            strcmp(ref.node, link->ec->thisnodename) == 0 ) {
+        seq = (zend_ulong) ref.n[0] | (zend_ulong) ref.n[1] << 18;
+
+        if ( (h=zend_hash_index_find_ptr(&PEB_G(rpc_pending), seq)) != NULL && h->link == link ) {
+            /* Same layout as the peb_rpc() reply, the bare term */
+            x.index -= index;
+            memmove(x.buff, x.buff + index, x.index);
+            h->reply = x;
+            h->state = PEB_RPC_DONE;
+            zend_hash_index_del(&PEB_G(rpc_pending), seq);
+            return 0;
+        }
+    }
+    ei_x_free(&x);
+
+    if ( result == ERL_ERROR ) {
+        if ( erl_errno == ETIMEDOUT ) {
+            return ERL_TIMEOUT;
+        }
+        _peb_rpc_fail(link);
+    }
+
+    return result < 0 ? ERL_ERROR : 0;
+}
+
+/*
+ * Waits for the reply to a call until deadline, a monotonic time in
+ * milliseconds or 0 for no limit. Errors are left in peb_error().
+ */
+static int _peb_rpc_wait(peb_rpc_handle* h, zend_long deadline)
+{
+    struct pollfd   pfd;
+    zend_long       tmo = 0;
+    int             result;
+
+    while ( h->state == PEB_RPC_PENDING ) {
+        if ( h->link_res->ptr != h->link ) {
+            /* closed meanwhile */
+            zend_hash_index_del(&PEB_G(rpc_pending), h->seq);
+            h->state = PEB_RPC_FAILED;
+            break;
+        }
+        /* Past the deadline, replies already there are still taken */
+        if ( deadline > 0 && (tmo=deadline - _peb_now_ms()) <= 0 ) {
+            pfd.fd = h->link->fd;
+            pfd.events = POLLIN;
+            if ( poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN) ) {
+                _peb_timed_out(deadline);
+                return FAILURE;
+            }
+            tmo = 1;
+        }
+
+        if ( (result=_peb_rpc_pump(h->link, tmo)) == ERL_TIMEOUT ) {
+            _peb_timed_out(deadline);
+            return FAILURE;
+        }
+    }
+
+    if ( h->state != PEB_RPC_DONE ) {
+        PEB_G(errorno) = PEB_ERRORNO_RECV;
+        PEB_G(error) = estrdup(PEB_ERROR_RECV);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Hands the reply over as a message resource, the handle is spent after
+ */
+static void _peb_rpc_take(peb_rpc_handle* h, zval* rv)
+{
+    ei_x_buff*      buff = emalloc(sizeof(ei_x_buff));
+
+    *buff = h->reply;
+    h->state = PEB_RPC_TAKEN;
+    ZVAL_RES(rv, zend_register_resource(buff, le_msgbuff));
+}
+
+/*
+ * Sends an RPC request to rex. With a ref it is a gen_server call whose
+ * reply is {Ref, Reply}, without it the plain {Self, {call, ...}} request
+ * ei_rpc_to() sends, answered by {rex, Reply}.
+ */
+static int _peb_rpc_send(peb_link* peb, erlang_ref* ref, const char* module, size_t module_len,
+        const char* func, size_t func_len, const ei_x_buff* args, zend_long deadline)
+{
+    ei_x_buff   x;
+    zend_long   tmo;
+    int         result;
+
+    ei_x_new_with_version(&x);
+    if ( (ref != NULL && (ei_x_encode_tuple_header(&x, 3) < 0 ||
+                ei_x_encode_atom(&x, "$gen_call") < 0)) ||
+            ei_x_encode_tuple_header(&x, 2) < 0 ||
+            ei_x_encode_pid(&x, ei_self(peb->ec)) < 0 ||
+            (ref != NULL && ei_x_encode_ref(&x, ref) < 0) ||
+            ei_x_encode_tuple_header(&x, 5) < 0 ||
+            ei_x_encode_atom(&x, "call") < 0 ||
+            ei_x_encode_atom_len(&x, module, (int) module_len) < 0 ||
+            ei_x_encode_atom_len(&x, func, (int) func_len) < 0 ||
+            _peb_x_put_term(&x, args) == FAILURE ||
+            ei_x_encode_atom(&x, "user") < 0 ) {
+        PEB_G(errorno) = PEB_ERRORNO_ENCODE;
+        PEB_G(error) = estrdup(PEB_ERROR_ENCODE);
+        ei_x_free(&x);
+        return FAILURE;
+    }
+
+    if ( (tmo=_peb_remaining(deadline)) < 0 ) {
+        ei_x_free(&x);
+        return FAILURE;
+    }
+
+    result = ei_reg_send_tmo(peb->ec, peb->fd, "rex", x.buff, x.index, tmo);
+    if ( result < 0 && _peb_link_retry(peb, deadline) && (tmo=_peb_remaining(deadline)) >= 0 ) {
+        result = ei_reg_send_tmo(peb->ec, peb->fd, "rex", x.buff, x.index, tmo);
+    }
+    ei_x_free(&x);
+
+    if ( result < 0 ) {
+        _peb_fail(deadline, PEB_ERRORNO_SEND, PEB_ERROR_SEND);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
 /*
  * Functiomn sends and receive an RPC request to/from a remote node
  *
  * Prototype:
- *      resource peb_rpc(string module, string function, resource message [, resource link_identifier])
+ *      resource peb_rpc(string module, string function, resource message [, resource link_identifier [, int timeout]])
  *
  * Parameters:
  *      module          module name
@@ -789,6 +2090,8 @@ PHP_FUNCTION(peb_receive)
  *      messageid       formatted message id
  *      linkid          node link identifier (If linkid isn't specified,
  *                      the last opened link is used)
+ *      timeout         timeout for the whole call in milliseconds, default
+ *                      is no timeout other than the request deadline
  * Return:
  *      messageid       message received
  *      false           receive failed
@@ -800,16 +2103,17 @@ PHP_FUNCTION(peb_rpc)
     peb_link*       peb;
     zval*           message = NULL;
     char            *module, *func;
-    int             module_len, func_len;
+    size_t          module_len, func_len;
+    zend_long       tmo = 0, deadline;
     ei_x_buff*      newbuff;
-    ei_x_buff*      result_buff;
-    int             result;
+    erlang_ref      ref;
+    peb_rpc_handle* h;
 
     PEB_G(error) = NULL;
     PEB_G(errorno) = 0;
 
-    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "ssr|r!", &module, &module_len,
-            &func, &func_len, &message, &peb_linkid) == FAILURE )  {
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "ssr|r!l", &module, &module_len,
+            &func, &func_len, &message, &peb_linkid, &tmo) == FAILURE )  {
         RETURN_FALSE;
     }
 
@@ -831,31 +2135,44 @@ PHP_FUNCTION(peb_rpc)
         RETURN_FALSE;
     }
 
-    result_buff = emalloc(sizeof(ei_x_buff));
-    ei_x_new(result_buff);
-
-    result = ei_rpc(peb->ec, peb->fd, module, func, newbuff->buff, newbuff->index, result_buff);
-
-    //php_printf("ei_rpc ret: %d\r\n<br />", result);
+    /*
+     * A call of its own, unlike ei_rpc() a reply coming in after the
+     * deadline is told apart and dropped instead of being taken for the
+     * reply to the next call on the link.
+     */
+    deadline = _peb_deadline(tmo);
+    h = ecalloc(1, sizeof(peb_rpc_handle));
+    h->link_res = linkid;
+    h->link = peb;
+    h->seq = ++PEB_G(rpc_seq);
+    h->state = PEB_RPC_PENDING;
+    _peb_rpc_ref(peb, h->seq, &ref);
+
+    if ( _peb_rpc_send(peb, &ref, module, module_len, func, func_len, newbuff, deadline) == FAILURE ) {
+        efree(h);
+        RETURN_FALSE;
+    }
 
-    if ( result < 0 ) {
-        /* process peb_error here */
-        PEB_G(errorno) = PEB_ERRORNO_SEND;
-        PEB_G(error) = estrdup(PEB_ERROR_SEND);
+    zend_hash_index_update_ptr(&PEB_G(rpc_pending), h->seq, h);
 
-        ei_x_free(result_buff);
-        efree(result_buff);
-        RETURN_FALSE;
+    if ( _peb_rpc_wait(h, deadline) == SUCCESS ) {
+        _peb_rpc_take(h, return_value);
+    }
+    else {
+        if ( h->state == PEB_RPC_PENDING ) {
+            zend_hash_index_del(&PEB_G(rpc_pending), h->seq);
+        }
+        RETVAL_FALSE;
     }
 
-    RETVAL_RES(zend_register_resource(result_buff, le_msgbuff));
+    efree(h);
 }
 
 /*
  * Functiomn sends an RPC request to a remote node
  *
  * Prototype:
- *      boolean peb_rpc_to(string module, string function, resource message [, resource link_identifier])
+ *      boolean peb_rpc_to(string module, string function, resource message [, resource link_identifier [, int timeout]])
  *
  * Parameters:
  *      module          module name
@@ -863,6 +2180,7 @@ PHP_FUNCTION(peb_rpc)
  *      messageid       formatted message id
  *      linkid          node link identifier (If linkid isn't specified,
  *                      the last opened link is used)
+ *      timeout         send timeout in milliseconds, default is no timeout
  * Return:
  *     true             rpc send successfully
  *     false            rpc failure
@@ -874,15 +2192,15 @@ PHP_FUNCTION(peb_rpc_to)
     peb_link*       peb;
     zval*           message = NULL;
     char            *module, *func;
-    int             module_len, func_len;
+    size_t          module_len, func_len;
+    zend_long       tmo = 0;
     ei_x_buff*      newbuff;
-    int             result;
 
     PEB_G(error) = NULL;
     PEB_G(errorno) = 0;
 
-    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "ssr|r!", &module, &module_len,
-            &func, &func_len, &message, &peb_linkid) == FAILURE )  {
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "ssr|r!l", &module, &module_len,
+            &func, &func_len, &message, &peb_linkid, &tmo) == FAILURE )  {
         RETURN_FALSE;
     }
 
@@ -904,535 +2222,6025 @@ PHP_FUNCTION(peb_rpc_to)
         RETURN_FALSE;
     }
 
-    result = ei_rpc_to(peb->ec, peb->fd, module, func, newbuff->buff, newbuff->index);
-    if ( result < 0 ) {
-        /* process peb_error here */
-        PEB_G(errorno) = PEB_ERRORNO_SEND;
-        PEB_G(error) = estrdup(PEB_ERROR_SEND);
+    if ( _peb_rpc_send(peb, NULL, module, module_len, func, func_len, newbuff, _peb_deadline(tmo)) == FAILURE ) {
         RETURN_FALSE;
     }
 
     RETURN_TRUE;
 }
 
-static void _peb_encode_term(ei_x_buff* x, char** fmt, int* fmtpos, HashTable* arr, zend_long* arridx)
+static zend_always_inline uint32_t _peb_get32be(const unsigned char* s)
 {
-    char*           p = *fmt + *fmtpos;
-    int             i,v;
-    zval*           pdata;
-    ei_x_buff       *newbuff, decoded;
-    peb_link*       peb;
-    erlang_pid*     ep;
-
-    ++p;
-    (*fmtpos)++;
-
-    while ( *p == ' ' ) {
-        ++p;
-        (*fmtpos)++;
-    }
-
-    switch ( *p ) {
-        case 'a':
-            if ( (pdata=zend_hash_index_find(arr, (zend_long)(*arridx))) != NULL ) {
-                newbuff = emalloc(sizeof(ei_x_buff));
-                ei_x_new(newbuff);
-                ei_x_encode_atom(newbuff, Z_STRVAL_P(pdata));
-                ei_x_append(x, newbuff);
-                ei_x_free(newbuff);
-                efree(newbuff);
-            }
-
-            ++(*arridx);
-            break;
-
-        case 's':
-            if ( (pdata=zend_hash_index_find(arr, *arridx)) != NULL ) {
-                newbuff = emalloc(sizeof(ei_x_buff));
-                ei_x_new(newbuff);
-                ei_x_encode_string_len(newbuff, Z_STRVAL_P(pdata), Z_STRLEN_P(pdata));
-                ei_x_append(x, newbuff);
-                ei_x_free(newbuff);
-                efree(newbuff);
-            }
-            ++(*arridx);
-            break;
-
-        case 'b':
-            if ( (pdata=zend_hash_index_find(arr, *arridx)) != NULL ) {
-                newbuff = emalloc(sizeof(ei_x_buff));
-                ei_x_new(newbuff);
-                ei_x_encode_binary(newbuff, Z_STRVAL_P(pdata),Z_STRLEN_P(pdata));
-                ei_x_append(x, newbuff);
-                ei_x_free(newbuff);
-                efree(newbuff);
-            }
-            ++(*arridx);
-            break;
-
-        case 'i':
-        case 'l':
-        case 'u':
-            if( (pdata=zend_hash_index_find(arr, *arridx)) != NULL ) {
-                newbuff = emalloc(sizeof(ei_x_buff));
-                ei_x_new(newbuff);
-                ei_x_encode_long(newbuff, Z_LVAL_P(pdata));
-                ei_x_append(x, newbuff);
-                ei_x_free(newbuff);
-                efree(newbuff);
-            }
-            ++(*arridx);
-            break;
-
-        case 'f':
-        case 'd':
-            if ( (pdata=zend_hash_index_find(arr, *arridx)) != NULL ) {
-                newbuff = emalloc(sizeof(ei_x_buff));
-                ei_x_new(newbuff);
-                ei_x_encode_double(newbuff, Z_DVAL_P(pdata));
-                ei_x_append(x, newbuff);
-                ei_x_free(newbuff);
-                efree(newbuff);
-            }
-            ++(*arridx);
-            break;
-
-        case 'p':
-            if ( (pdata=zend_hash_index_find(arr, *arridx)) != NULL ) {
-                //m = (peb_link*) zend_fetch_resource(pdata TSRMLS_CC,-1 , PEB_RESOURCENAME , NULL, 2, le_link, le_plink);
-                peb = (peb_link*)zend_fetch_resource2_ex(pdata, PEB_RESOURCENAME, le_link, le_plink);
-                if ( peb ) {
-                    newbuff = emalloc(sizeof(ei_x_buff));
-                    ei_x_new(newbuff);
-                    ei_x_encode_pid(newbuff, &(peb->ec->self));
-                    ei_x_append(x, newbuff);
-                    ei_x_free(newbuff);
-                    efree(newbuff);
-                }
-            }
-            ++(*arridx);
-            break;
-
-        case 'P':
-            if ( (pdata=zend_hash_index_find(arr, *arridx)) != NULL ) {
-                //ep = (erlang_pid*) zend_fetch_resource(pdata TSRMLS_CC,-1 , PEB_SERVERPID , NULL, 1, le_serverpid);
-                ep = (erlang_pid*)zend_fetch_resource_ex(pdata, PEB_SERVERPID, le_serverpid);
-                if ( ep ) {
-                    newbuff = emalloc(sizeof(ei_x_buff));
-                    ei_x_new(newbuff);
-                    ei_x_encode_pid(newbuff, ep);
-                    ei_x_append(x, newbuff);
-                    ei_x_free(newbuff);
-                    efree(newbuff);
-                }
-            }
-            ++(*arridx);
-            break;
-
-        case ',':
-        case '~':
-            break;
+    return ((uint32_t) s[0] << 24) | ((uint32_t) s[1] << 16) | ((uint32_t) s[2] << 8) | s[3];
+}
 
-        default:
-            return;
-    }
+static zend_always_inline void _peb_put16be(char* s, uint32_t v)
+{
+    s[0] = (char)(v >> 8);
+    s[1] = (char)(v);
+}
 
-    _peb_encode_term(x, fmt, fmtpos, arr, arridx);
+static zend_always_inline void _peb_put32be(char* s, uint32_t v)
+{
+    s[0] = (char)(v >> 24);
+    s[1] = (char)(v >> 16);
+    s[2] = (char)(v >> 8);
+    s[3] = (char)(v);
 }
 
 /*
- *  ~a - an atom, char*
- *  ~s - a string, char*
- *  ~b - a binary, char*
- *  ~i - an integer, int
- *  ~l - a long integer, long int
- *  ~u - an unsigned long integer, unsigned long int
- *  ~f - a float, float
- *  ~d - a double float, double float
- *  ~p - an erlang pid
+ * Finds the end of the encoded term at index. Unlike ei_skip_term() no
+ * length in the term is trusted beyond size, so it is safe on bytes from
+ * outside. Only the number of terms left to skip is kept, nesting takes no
+ * stack. Returns the end, or -1 when the term is cut short or unknown.
  */
-static void _peb_encode(ei_x_buff* x, char** fmt, int fmt_len, int* fmtpos, HashTable* arr, zend_long* arridx)
-{
-    char*           p = *fmt + (*fmtpos);
-    int             res;
-    zend_long       newidx = 0;
+#define PEB_NEED(k) if ( size - index < (k) ) { return -1; }
 
-    HashTable*      newarr;
-    zval*           tmp;
-    ei_x_buff*      newbuff;
+static int _peb_term_end(const char* buff, int size, int index)
+{
+    const unsigned char*    s = (const unsigned char*) buff;
+    zend_ulong              pending = 1;
+    zend_ulong              n;
+    int                     node, pre;
+
+    while ( pending-- > 0 ) {
+        PEB_NEED(1);
+        node = -1;
+        pre = 0;
+        n = 0;
+
+        switch ( s[index] ) {
+            case ERL_NIL_EXT:               n = 0;                  break;
+            case ERL_SMALL_INTEGER_EXT:     n = 1;                  break;
+            case ERL_INTEGER_EXT:           n = 4;                  break;
+            case NEW_FLOAT_EXT:             n = 8;                  break;
+            case ERL_FLOAT_EXT:             n = 31;                 break;
+
+            case ERL_SMALL_ATOM_EXT:
+            case ERL_SMALL_ATOM_UTF8_EXT:
+            case ERL_SMALL_BIG_EXT:
+                PEB_NEED(2);
+                n = 1 + s[index+1] + (s[index] == ERL_SMALL_BIG_EXT);
+                break;
 
-    while ( *p == ' ' ) {
-        ++p;
-        (*fmtpos)++;
-    }
+            case ERL_ATOM_EXT:
+            case ERL_ATOM_UTF8_EXT:
+            case ERL_STRING_EXT:
+                PEB_NEED(3);
+                n = 2 + ((s[index+1] << 8) | s[index+2]);
+                break;
 
-    // Special case, empty list.
-    if ( *p == '[' && *(p+1) == ']') {
-        // php_printf("Inside IF: fmt_len: %d\n", fmt_len);
+            case ERL_BINARY_EXT:
+                PEB_NEED(5);
+                n = 4 + (zend_ulong) _peb_get32be(s + index + 1);
+                break;
 
-        ei_x_encode_empty_list(x);
-        ++p; //consume current char
-        (*fmtpos)++;
-        ++p; //consume ] char
-        (*fmtpos)++;
-  
-        (*arridx)++;
-  
-        if ( (fmt_len-1) <= *fmtpos ) {
-            // php_printf("\n\n\n\nfmt_len: %d fmtpos %d\n\n\n\n", fmt_len, *fmtpos);
-            return;
-        }
-        _peb_encode(x,fmt,fmt_len,fmtpos,arr,arridx);
-    }
+            case ERL_BIT_BINARY_EXT:
+            case ERL_LARGE_BIG_EXT:
+                PEB_NEED(5);
+                n = 5 + (zend_ulong) _peb_get32be(s + index + 1);
+                break;
 
-    switch ( *p ) {
-        case '~':
-            _peb_encode_term(x, fmt, fmtpos, arr, arridx);
-            break;
+            case ERL_SMALL_TUPLE_EXT:
+                PEB_NEED(2);
+                n = 1;
+                pending += s[index+1];
+                break;
 
-        case '[':
-            if ( (tmp=zend_hash_index_find(arr, *arridx)) != NULL) {
-                ZVAL_DEREF(tmp);
-                newarr = Z_ARRVAL_P(tmp);
-        
-                //empty list handling
-                if ( zend_hash_num_elements(newarr) == 0 && *(p+1) == '[' && *(p+2) == ']') {
-                    ei_x_encode_empty_list(x);
-                    ++p;                //advance from current char
-                    (*fmtpos)++;
-                    ++p;                //skip [
-                    (*fmtpos)++;
-                    ++p;                //skip ]
-                    (*fmtpos)++;
-                    (*arridx)++;
-                    break;
-                }
-          
-                ++p;
-                (*fmtpos)++;
-                newbuff = emalloc(sizeof(ei_x_buff));
-                ei_x_new(newbuff);
-
-                _peb_encode(newbuff, fmt, fmt_len, fmtpos, newarr, &newidx);
-       
-                if( newidx != 0 ) {
-                    /* php_printf("newidx:%d",newidx); */
-                    ei_x_encode_list_header(x, newidx);
-                    ei_x_append(x, newbuff);
-                    ei_x_encode_empty_list(x);
-                    ei_x_free(newbuff);
-                    efree(newbuff);
+            case ERL_LARGE_TUPLE_EXT:
+            case ERL_LIST_EXT:
+            case ERL_MAP_EXT:
+            case ERL_FUN_EXT:
+                PEB_NEED(5);
+                n = 4;
+                if ( s[index] == ERL_MAP_EXT ) {
+                    pending += 2 * (zend_ulong) _peb_get32be(s + index + 1);
                 }
                 else {
-                    ei_x_free(newbuff);
-                    efree(newbuff);
+                    /* A list has its tail, an old fun its pid, module, index and uniq */
+                    pending += (zend_ulong) _peb_get32be(s + index + 1) +
+                            (s[index] == ERL_LIST_EXT ? 1 : s[index] == ERL_FUN_EXT ? 4 : 0);
                 }
-            }
-            (*arridx)++;
-            break;
-
-        case ']':
-            ++p;
-            (*fmtpos)++;
-            return;
-            break;
+                break;
 
-        case '{':
-            if ( (tmp=zend_hash_index_find(arr, *arridx)) != NULL) {
-                ZVAL_DEREF(tmp);
-                newarr = Z_ARRVAL_P(tmp);
-
-                ++p;
-                (*fmtpos)++;
-                newbuff = emalloc(sizeof(ei_x_buff));
-                ei_x_new(newbuff);
-
-                _peb_encode(newbuff, fmt, fmt_len, fmtpos, newarr, &newidx);
-                if ( newidx !=0 ) {
-                    /* php_printf("newidx:%d",newidx); */
-                    ei_x_encode_tuple_header(x, newidx);
-                    ei_x_append(x, newbuff);
-                    ei_x_free(newbuff);
-                    efree(newbuff);
-                }
-                else {
-                    ei_x_free(newbuff);
-                    efree(newbuff);
+            case ERL_NEW_FUN_EXT:
+                /* Size counts itself but not the tag */
+                PEB_NEED(5);
+                if ( (n=_peb_get32be(s + index + 1)) < 4 ) {
+                    return -1;
                 }
-            }
-            (*arridx)++;
-            break;
-
-        case '}':
-            ++p;
-            (*fmtpos)++;
-            return;
-            break;
-
-        case ',':
-            ++p;
-            (*fmtpos)++;
-            break;
+                break;
 
-        default:
-            return;
-            break;
-    }
+            case ERL_EXPORT_EXT:
+                pending += 3;
+                break;
 
-    _peb_encode(x, fmt, fmt_len, fmtpos, arr, arridx);
-}
+            /* Node atom, then fixed size fields */
+            case ERL_PID_EXT:               node = 9;               break;
+            case ERL_NEW_PID_EXT:           node = 12;              break;
+            case ERL_PORT_EXT:              node = 5;               break;
+            case ERL_REFERENCE_EXT:         node = 5;               break;
+            case ERL_NEW_PORT_EXT:          node = 8;               break;
+            case ERL_V4_PORT_EXT:           node = 12;              break;
+
+            case ERL_NEW_REFERENCE_EXT:
+            case ERL_NEWER_REFERENCE_EXT:
+                PEB_NEED(3);
+                pre = 2;
+                node = (s[index] == ERL_NEW_REFERENCE_EXT ? 1 : 4) + 4 * ((s[index+1] << 8) | s[index+2]);
+                break;
 
-static void php_peb_encode_impl(INTERNAL_FUNCTION_PARAMETERS, int with_version)
-{
-    char*           fmt;
-    int             fmt_len;
-    int             fmtpos = 0;
-    int             res;
-    zend_long       arridx = 0;
+            default:
+                return -1;
+        }
 
-    zval*           tmp;
-    ei_x_buff*      x;
-    HashTable*      htable;
+        index += 1 + pre;
 
-    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "sa", &fmt, &fmt_len, &tmp) == FAILURE )  {
-        RETURN_FALSE;
-    }
+        if ( node >= 0 ) {
+            PEB_NEED(2);
+            if ( s[index] == ERL_SMALL_ATOM_EXT || s[index] == ERL_SMALL_ATOM_UTF8_EXT ) {
+                n = 2 + s[index+1];
+            }
+            else if ( s[index] == ERL_ATOM_EXT || s[index] == ERL_ATOM_UTF8_EXT ) {
+                PEB_NEED(3);
+                n = 3 + ((s[index+1] << 8) | s[index+2]);
+            }
+            else {
+                return -1;
+            }
+            n += node;
+        }
 
-    /* find hashtable for array */
-    ZVAL_DEREF(tmp);
-    htable = Z_ARRVAL_P(tmp);
+        if ( n > (zend_ulong) (size - index) ) {
+            return -1;
+        }
+        index += (int) n;
 
-    x = emalloc(sizeof(ei_x_buff));
-    if ( with_version ) {
-        ei_x_new_with_version(x);
-    }
-    else {
-        ei_x_new(x);
+        /* Every term left takes at least one byte */
+        if ( pending > (zend_ulong) (size - index) ) {
+            return -1;
+        }
     }
 
-    _peb_encode(x, &fmt, fmt_len, &fmtpos, htable, &arridx);
-    RETVAL_RES(zend_register_resource(x, le_msgbuff));
+    return index;
 }
 
+#undef PEB_NEED
+
 /*
- * Encodes the PHP variables to Erlang terms according to the specified format
- * with version number
+ * Sends an already encoded Erlang message, as kept by a cache, to a
+ * registered process or a pid. The bytes go out as they are, without a
+ * term resource in between.
  *
  * Prototype:
- *      resource peb_vencode(string format, array data)
+ *      boolean peb_send_raw(mixed to, string message [, resource linkid [, int timeout]])
  *
  * Parameters:
- *      format          format string
- *      data            array data to formatting
+ *      to              registered process name or pid
+ *      message         one encoded term starting with the version number,
+ *                      as returned by peb_term_to_string()
+ *      linkid          node link identifier (If linkid isn't specified,
+ *                      the last opened link is used)
+ *      timeout         send timeout in milliseconds, default is no timeout
  *
  * Return:
- *     messageid        success
- *     false            failure
+ *      true            send successfull
+ *      false           send failure
  */
-PHP_FUNCTION(peb_vencode)
+PHP_FUNCTION(peb_send_raw)
 {
+    zend_resource*  linkid;
+    zval*           peb_linkid = NULL;
+    peb_link*       peb;
+    zval*           to = NULL;
+    char*           message;
+    size_t          message_len;
+    zend_long       tmo = 0, deadline;
+    erlang_pid*     serverpid;
+    zend_string*    name;
+    int             result;
+
     PEB_G(error) = NULL;
     PEB_G(errorno) = 0;
 
-    php_peb_encode_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "zs|rl", &to, &message, &message_len,
+            &peb_linkid, &tmo) == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    if ( ZEND_NUM_ARGS() > 2 )  {
+        linkid = Z_RES_P(peb_linkid);
+    }
+    else {
+        linkid = PEB_G(default_link);
+        if ( !linkid )  {
+            RETURN_FALSE;
+        }
+    }
+
+    if ( (peb=(peb_link*)zend_fetch_resource2(linkid, PEB_RESOURCENAME, le_link, le_plink)) == NULL )  {
+        RETURN_FALSE;
+    }
+
+    /* The version number and exactly one whole term, the node trusts what it gets */
+    if ( message_len < 2 || message_len > INT_MAX || (unsigned char) message[0] != ERL_VERSION_MAGIC ||
+            _peb_term_end(message, (int) message_len, 1) != (int) message_len ) {
+        PEB_G(errorno) = PEB_ERRORNO_SEND;
+        PEB_G(error) = estrdup(PEB_ERROR_SEND);
+        RETURN_FALSE;
+    }
+
+    deadline = _peb_deadline(tmo);
+    if ( (tmo=_peb_remaining(deadline)) < 0 ) {
+        RETURN_FALSE;
+    }
+
+    if ( Z_TYPE_P(to) == IS_RESOURCE ) {
+        if ( (serverpid=(erlang_pid*)zend_fetch_resource(Z_RES_P(to), PEB_SERVERPID, le_serverpid)) == NULL ) {
+            RETURN_FALSE;
+        }
+        result = ei_send_tmo(peb->fd, serverpid, message, (int) message_len, tmo);
+        if ( result < 0 && _peb_link_retry(peb, deadline) && (tmo=_peb_remaining(deadline)) >= 0 ) {
+            result = ei_send_tmo(peb->fd, serverpid, message, (int) message_len, tmo);
+        }
+    }
+    else {
+        name = zval_get_string(to);
+        result = ei_reg_send_tmo(peb->ec, peb->fd, ZSTR_VAL(name), message, (int) message_len, tmo);
+        if ( result < 0 && _peb_link_retry(peb, deadline) && (tmo=_peb_remaining(deadline)) >= 0 ) {
+            result = ei_reg_send_tmo(peb->ec, peb->fd, ZSTR_VAL(name), message, (int) message_len, tmo);
+        }
+        zend_string_release(name);
+    }
+
+    if ( result < 0 ) {
+        /* process peb_error here */
+        _peb_fail(deadline, PEB_ERRORNO_SEND, PEB_ERROR_SEND);
+        RETURN_FALSE;
+    }
+
+    RETURN_TRUE;
 }
 
 /*
- * Encodes the PHP variables to Erlang terms according to the specified format
- * without version number
+ * Writes iov out in as few calls as the socket takes, until deadline.
+ * Returns the number of bytes written, short when the link failed or the
+ * deadline passed; the error is left in peb_error().
+ */
+static size_t _peb_sendv(peb_link* peb, struct iovec* iov, int iovcnt, zend_long deadline)
+{
+    struct msghdr   mh;
+    struct pollfd   pfd;
+    zend_long       tmo;
+    size_t          written = 0;
+    ssize_t         n;
+    int             flags = 0;
+
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+    if ( deadline > 0 ) {
+        flags |= MSG_DONTWAIT;
+    }
+
+    while ( iovcnt > 0 ) {
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = MIN(iovcnt, PEB_IOV_MAX);
+
+        if ( (n=sendmsg(peb->fd, &mh, flags)) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                if ( (tmo=_peb_remaining(deadline)) < 0 ) {
+                    break;
+                }
+                pfd.fd = peb->fd;
+                pfd.events = POLLOUT;
+                if ( poll(&pfd, 1, tmo > 0 ? (int) MIN(tmo, INT_MAX) : -1) >= 0 ) {
+                    continue;
+                }
+            }
+            _peb_fail(0, PEB_ERRORNO_SEND, PEB_ERROR_SEND);
+            break;
+        }
+
+        written += n;
+        while ( iovcnt > 0 && (size_t) n >= iov->iov_len ) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if ( n > 0 ) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return written;
+}
+
+/*
+ * Sends a batch of Erlang messages over one link. The distribution
+ * headers are all built up front and the messages written together, a
+ * few system calls for the whole batch instead of one or more each.
  *
  * Prototype:
- *      resource peb_encode(string format, array data)
+ *      array peb_send_many(resource linkid, array messages [, int timeout])
  *
  * Parameters:
- *      format          format string
- *      data            array data to formatting
+ *      linkid          node link identifier
+ *      messages        list of [to, messageid] pairs, to being a registered
+ *                      process name or a process identifier
+ *      timeout         timeout for the whole batch in milliseconds, default
+ *                      is no timeout
  *
  * Return:
- *     messageid        success
- *     false            failure
+ *      array           true or false for every message, under its key
+ *      false           bad arguments
+ *
+ * A write that stops inside a message leaves the node unable to read the
+ * rest of the stream, so the link is closed and its pending
+ * peb_rpc_async() calls fail. A persistent link connects again on its next
+ * send or peb_pconnect(), a link from peb_connect() has to be closed and
+ * opened anew.
  */
-PHP_FUNCTION(peb_encode)
+PHP_FUNCTION(peb_send_many)
 {
+    zval*           peb_linkid;
+    zval*           messages;
+    zval*           entry;
+    zval*           to;
+    zval*           term;
+    zval            rv;
+    zend_string*    key;
+    zend_ulong      idx;
+    peb_link*       peb;
+    zend_long       tmo = 0, deadline;
+    ei_x_buff       x;
+    ei_x_buff*      buff;
+    erlang_pid*     serverpid;
+    zend_string*    name;
+    struct iovec*   iov;
+    int*            frames;
+    int             count, i = 0, n = 0, hdr, magic, result;
+    size_t          written, start, end = 0;
+
     PEB_G(error) = NULL;
     PEB_G(errorno) = 0;
 
-    php_peb_encode_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
-}
-
-static int _peb_decode(ei_x_buff* x, zval* htable) {
-    zval        z;
-    int         type;
-    int         size;
-    char*       buff;
-    long        len;
-    long        long_value;
-    double      double_value;
-    int         i;
-  
-    ei_get_type(x->buff, &x->index, &type, &size);
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "ra|l", &peb_linkid, &messages, &tmo) == FAILURE ) {
+        RETURN_FALSE;
+    }
 
-    switch ( type )  {
-        case ERL_ATOM_EXT:
-            buff = emalloc(size+1);
-            ei_decode_atom(x->buff, &x->index, buff);
-            buff[size] = '\0';
-            ZVAL_STRING(&z, buff);
-            add_next_index_zval(htable, &z);
-            efree(buff);
-            break;
+    if ( (peb=(peb_link*)zend_fetch_resource2(Z_RES_P(peb_linkid), PEB_RESOURCENAME, le_link, le_plink)) == NULL )  {
+        RETURN_FALSE;
+    }
 
-        case ERL_STRING_EXT:
-            buff = emalloc(size+1);
-            ei_decode_string(x->buff, &x->index, buff);
-            buff[size] = '\0';
-            ZVAL_STRING(&z, buff);
-            add_next_index_zval(htable, &z);
-            efree(buff);
-            break;
+    count = zend_hash_num_elements(Z_ARRVAL_P(messages));
+    array_init_size(return_value, count);
+    if ( count == 0 ) {
+        return;
+    }
 
-        case ERL_BINARY_EXT:
-            buff = emalloc(size);
-            ei_decode_binary(x->buff, &x->index, buff, &len);
-            ZVAL_STRINGL(&z, buff, size);
-            add_next_index_zval(htable, &z);
-            efree(buff);
-            break;
+    /* Header of message i at frames[i], -1 when it is not sent */
+    frames = safe_emalloc(count, sizeof(int), 0);
+    memset(frames, 0xff, count * sizeof(int));
+    ei_x_new(&x);
 
-        case ERL_PID_EXT:
-            buff = emalloc(sizeof(erlang_pid));
-            ei_decode_pid(x->buff, &x->index, (erlang_pid*)buff);
-            //ZEND_REGISTER_RESOURCE(z, buff, le_serverpid);
-            ZVAL_RES(&z, zend_register_resource(buff, le_serverpid));
-            add_next_index_zval(htable, &z);
-            break;
+    ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(messages), entry) {
+        ZVAL_DEREF(entry);
 
-        case ERL_SMALL_BIG_EXT:
-        case ERL_SMALL_INTEGER_EXT:
-        case ERL_INTEGER_EXT:
-            ei_decode_long(x->buff, &x->index, &long_value);
-            ZVAL_LONG(&z, long_value);
-            add_next_index_zval(htable, &z);
-            break;
+        if ( Z_TYPE_P(entry) != IS_ARRAY ||
+                (to=zend_hash_index_find(Z_ARRVAL_P(entry), 0)) == NULL ||
+                (term=zend_hash_index_find(Z_ARRVAL_P(entry), 1)) == NULL ) {
+            i++;
+            continue;
+        }
+        ZVAL_DEREF(to);
+        ZVAL_DEREF(term);
+
+        if ( Z_TYPE_P(term) != IS_RESOURCE ||
+                (buff=(ei_x_buff*)zend_fetch_resource(Z_RES_P(term), PEB_TERMRESOURCE, le_msgbuff)) == NULL ||
+                buff->index <= 0 ) {
+            i++;
+            continue;
+        }
 
-        case ERL_FLOAT_EXT:
-            ei_decode_double(x->buff, &x->index, &double_value);
-            ZVAL_DOUBLE(&z, double_value);
-            add_next_index_zval(htable, &z);
+        /* Length, pass through, then the control message as ei_send() has it */
+        hdr = x.index;
+        magic = (unsigned char) buff->buff[0] != ERL_VERSION_MAGIC;
+        if ( _peb_x_reserve(&x, 5) == NULL ) {
             break;
+        }
+        x.index += 4;
+        x.buff[x.index++] = 'p';
+
+        if ( Z_TYPE_P(to) == IS_RESOURCE ) {
+            /* {SEND, Cookie, To} */
+            result = (serverpid=(erlang_pid*)zend_fetch_resource(Z_RES_P(to), PEB_SERVERPID, le_serverpid)) == NULL ||
+                    ei_x_encode_version(&x) < 0 ||
+                    ei_x_encode_tuple_header(&x, 3) < 0 ||
+                    ei_x_encode_long(&x, ERL_SEND) < 0 ||
+                    ei_x_encode_atom(&x, "") < 0 ||
+                    ei_x_encode_pid(&x, serverpid) < 0 ? FAILURE : SUCCESS;
+        }
+        else {
+            /* {REG_SEND, From, Cookie, ToName}, the name held to 255 characters like any atom */
+            name = zval_get_string(to);
+            result = ei_x_encode_version(&x) < 0 ||
+                    ei_x_encode_tuple_header(&x, 4) < 0 ||
+                    ei_x_encode_long(&x, ERL_REG_SEND) < 0 ||
+                    ei_x_encode_pid(&x, ei_self(peb->ec)) < 0 ||
+                    ei_x_encode_atom(&x, "") < 0 ||
+                    _peb_x_put_atom(&x, ZSTR_VAL(name), ZSTR_LEN(name)) != SUCCESS ? FAILURE : SUCCESS;
+            zend_string_release(name);
+        }
 
-        case ERL_SMALL_TUPLE_EXT:
-        case ERL_LARGE_TUPLE_EXT:
-            array_init(&z);
-            ei_decode_tuple_header(x->buff, &x->index, &size);
+        /* The message body goes out from its own buffer, without a copy */
+        if ( result == SUCCESS && magic && ei_x_encode_version(&x) < 0 ) {
+            result = FAILURE;
+        }
+        if ( result != SUCCESS ) {
+            x.index = hdr;
+            i++;
+            continue;
+        }
+        _peb_put32be(x.buff + hdr, (uint32_t) (x.index - hdr - 4 + buff->index));
+
+        frames[i++] = hdr;
+        n++;
+    } ZEND_HASH_FOREACH_END();
+
+    /* The header buffer is complete, its addresses no longer move */
+    iov = safe_emalloc(n, 2 * sizeof(struct iovec), 0);
+    n = 0;
+    i = 0;
+    ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(messages), entry) {
+        if ( frames[i] >= 0 ) {
+            ZVAL_DEREF(entry);
+            term = zend_hash_index_find(Z_ARRVAL_P(entry), 1);
+            ZVAL_DEREF(term);
+            buff = (ei_x_buff*) Z_RES_VAL_P(term);
+
+            iov[n].iov_base = x.buff + frames[i];
+            iov[n].iov_len = _peb_get32be((unsigned char*) x.buff + frames[i]) + 4 - buff->index;
+            iov[n + 1].iov_base = buff->buff;
+            iov[n + 1].iov_len = buff->index;
+            n += 2;
+        }
+        i++;
+    } ZEND_HASH_FOREACH_END();
 
-            for(i=1; i<=size; i++) {
-                if ( _peb_decode(x, &z) != SUCCESS )  {
-                    return FAILURE;
-                }
-            }
+    deadline = _peb_deadline(tmo);
+    written = n > 0 ? _peb_sendv(peb, iov, n, deadline) : 0;
 
-            add_next_index_zval(htable, &z);
-            break;
+    if ( n > 0 && written == 0 && _peb_link_retry(peb, deadline) ) {
+        /* Nothing went out over a dead link, the whole batch is sent again */
+        PEB_G(error) = NULL;
+        PEB_G(errorno) = 0;
+        written = _peb_sendv(peb, iov, n, deadline);
+    }
 
-        case ERL_NIL_EXT:
-        case ERL_LIST_EXT:
-            array_init(&z);
-            ei_decode_list_header(x->buff, &x->index, &size);
+    /* A message counts as sent once all of it is written */
+    i = 0;
+    ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(messages), idx, key, entry) {
+        start = end;
+        if ( frames[i] >= 0 ) {
+            end += _peb_get32be((unsigned char*) x.buff + frames[i]) + 4;
+        }
+        ZVAL_BOOL(&rv, frames[i] >= 0 && end <= written);
 
-            while ( size > 0 ) {
-                for(i=1; i<=size; i++)  {
-                    if ( _peb_decode(x, &z) != SUCCESS ) {
-                        return FAILURE;
-                    }
-                }
-                ei_decode_list_header(x->buff, &x->index, &size);
-            }
+        if ( key ) {
+            zend_hash_update(Z_ARRVAL_P(return_value), key, &rv);
+        }
+        else {
+            zend_hash_index_update(Z_ARRVAL_P(return_value), idx, &rv);
+        }
 
-            add_next_index_zval(htable, &z);
-            break;
+        /* The node would read the rest of the stream out of step */
+        if ( written > start && written < end ) {
+            _peb_link_drop(peb);
+        }
+        i++;
+    } ZEND_HASH_FOREACH_END();
 
-        default:
-            php_error(E_ERROR, "unsupported data type %d", type);
-            PEB_G(errorno) = PEB_ERRORNO_DECODE;
-            PEB_G(error) = estrdup(PEB_ERROR_DECODE);
-            return FAILURE;
+    if ( (size_t) end != written || n < 2 * count ) {
+        _peb_fail(0, PEB_ERRORNO_SEND, PEB_ERROR_SEND);
     }
 
-    return SUCCESS;
+    efree(iov);
+    efree(frames);
+    ei_x_free(&x);
 }
 
-static void php_peb_decode_impl(INTERNAL_FUNCTION_PARAMETERS, int with_version)
+/*
+ * Receive a message from the Erlang node that's associated with the
+ * specified link identifier, as the encoded term
+ *
+ * Prototype:
+ *      string peb_receive_raw([resource linkid [, int timeout]])
+ *
+ * Parameters:
+ *      linkid          node link identifier (If linkid isn't specified,
+ *                      the last opened link is used)
+ *      timeout         receive timeout in milliseconds, default is no timeout
+ *
+ * Return:
+ *      string          encoded term with the version number, to be cached,
+ *                      sent on with peb_send_raw() or read with
+ *                      peb_string_to_term()
+ *      false           receive failed
+ */
+PHP_FUNCTION(peb_receive_raw)
 {
-    zval*       tmp;
-    ei_x_buff*  x;
-    int         v, result;
-    zval        htable;
+    zend_resource*  linkid;
+    zval*           peb_linkid = NULL;
+    peb_link*       peb;
+    zend_long       tmo = 0, deadline;
+    ei_x_buff       x;
+    erlang_msg      message;
+    int             result;
 
-    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "r", &tmp) == FAILURE )  {
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "|rl", &peb_linkid, &tmo) == FAILURE ) {
         RETURN_FALSE;
     }
 
-    if ( (x=(ei_x_buff*)zend_fetch_resource(Z_RES_P(tmp), PEB_TERMRESOURCE, le_msgbuff)) == NULL ) {
+    if ( ZEND_NUM_ARGS() > 0 )  {
+        linkid = Z_RES_P(peb_linkid);
+    }
+    else {
+        linkid = PEB_G(default_link);
+        if ( !linkid )  {
+            RETURN_FALSE;
+        }
+    }
+
+    if ( (peb=(peb_link*)zend_fetch_resource2(linkid, PEB_RESOURCENAME, le_link, le_plink)) == NULL )  {
         RETURN_FALSE;
     }
 
-    x->index = 0;
-    if ( with_version ) {
-        ei_decode_version(x->buff, &x->index, &v);
+    ei_x_new(&x);
+    deadline = _peb_deadline(tmo);
+
+    do {
+        if ( (tmo=_peb_remaining(deadline)) < 0 ) {
+            ei_x_free(&x);
+            RETURN_FALSE;
+        }
+        result = ei_xreceive_msg_tmo(peb->fd, &message, &x, tmo);
+    } while ( result == ERL_TICK );
+
+    if ( result != ERL_MSG ) {
+        _peb_fail(deadline, PEB_ERRORNO_RECV, PEB_ERROR_RECV);
+        ei_x_free(&x);
+        RETURN_FALSE;
     }
 
-    array_init(&htable);
+    if ( message.msgtype != ERL_SEND ) {
+        PEB_G(errorno) = PEB_ERRORNO_NOTMINE;
+        PEB_G(error) = estrdup(PEB_ERROR_NOTMINE);
+        ei_x_free(&x);
+        RETURN_FALSE;
+    }
 
-    result = _peb_decode(x, &htable);
-    if ( result == SUCCESS ) {
-        RETURN_ARR(Z_ARRVAL_P(&htable));
+    /* x.index is the length of the message, the term itself is not parsed */
+    if ( x.index < 2 || (unsigned char) x.buff[0] != ERL_VERSION_MAGIC ) {
+        PEB_G(errorno) = PEB_ERRORNO_DECODE;
+        PEB_G(error) = estrdup(PEB_ERROR_DECODE);
+        ei_x_free(&x);
+        RETURN_FALSE;
+    }
+
+    RETVAL_STRINGL(x.buff, x.index);
+    ei_x_free(&x);
+}
+
+/*
+ * Sends an RPC request to a remote node without waiting for the reply
+ *
+ * Prototype:
+ *      resource peb_rpc_async(string module, string function, resource message [, resource linkid [, int timeout]])
+ *
+ * Parameters:
+ *      module          module name
+ *      function        function name
+ *      messageid       formatted message id
+ *      linkid          node link identifier (If linkid isn't specified,
+ *                      the last opened link is used)
+ *      timeout         send timeout in milliseconds, default is no timeout
+ *
+ * Return:
+ *      handle          call handle for peb_await() and peb_await_all()
+ *      false           rpc failure
+ */
+PHP_FUNCTION(peb_rpc_async)
+{
+    zend_resource*  linkid;
+    zval*           peb_linkid = NULL;
+    peb_link*       peb;
+    zval*           message = NULL;
+    char            *module, *func;
+    size_t          module_len, func_len;
+    zend_long       tmo = 0;
+    ei_x_buff*      newbuff;
+    erlang_ref      ref;
+    peb_rpc_handle* h;
+    zend_ulong      seq;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "ssr|r!l", &module, &module_len,
+            &func, &func_len, &message, &peb_linkid, &tmo) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    if ( peb_linkid )  {
+        linkid = Z_RES_P(peb_linkid);
     }
     else {
+        linkid = PEB_G(default_link);
+        if ( !linkid )  {
+            RETURN_FALSE;
+        }
+    }
+
+    if ( (peb=(peb_link*)zend_fetch_resource2(linkid, PEB_RESOURCENAME, le_link, le_plink)) == NULL )  {
+        RETURN_FALSE;
+    }
+
+    if ( (newbuff=(ei_x_buff*)zend_fetch_resource(Z_RES_P(message), PEB_TERMRESOURCE, le_msgbuff)) == NULL ) {
+        RETURN_FALSE;
+    }
+
+    seq = ++PEB_G(rpc_seq);
+    _peb_rpc_ref(peb, seq, &ref);
+
+    if ( _peb_rpc_send(peb, &ref, module, module_len, func, func_len, newbuff, _peb_deadline(tmo)) == FAILURE ) {
         RETURN_FALSE;
     }
+
+    h = ecalloc(1, sizeof(peb_rpc_handle));
+    h->link_res = linkid;
+    h->link = peb;
+    h->seq = seq;
+    h->state = PEB_RPC_PENDING;
+    GC_ADDREF(linkid);
+    zend_hash_index_update_ptr(&PEB_G(rpc_pending), seq, h);
+
+    RETVAL_RES(zend_register_resource(h, le_rpc));
 }
 
 /*
- * Decodes and Erlang term that was send without version magic number
+ * Waits for the reply to an asynchronous RPC request
  *
  * Prototype:
- *      mixed peb_decode(resource msgbuffer)
+ *      resource peb_await(resource handle [, int timeout])
  *
  * Parameters:
- *      msgbuffer       message
+ *      handle          call handle returned by peb_rpc_async()
+ *      timeout         receive timeout in milliseconds, default is no timeout
  *
  * Return:
- *     array            decodes assoc array
- *     false            decode failure
+ *      messageid       message received, as with peb_rpc()
+ *      false           receive failed or timed out, a timed out call can
+ *                      be waited for again
  */
-PHP_FUNCTION(peb_decode)
+PHP_FUNCTION(peb_await)
 {
+    zval*           handle;
+    zend_long       tmo = 0;
+    peb_rpc_handle* h;
+
     PEB_G(error) = NULL;
     PEB_G(errorno) = 0;
 
-    php_peb_decode_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "r|l", &handle, &tmo) == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    if ( (h=(peb_rpc_handle*)zend_fetch_resource(Z_RES_P(handle), PEB_RPCRESOURCE, le_rpc)) == NULL ) {
+        RETURN_FALSE;
+    }
+
+    if ( _peb_rpc_wait(h, _peb_deadline(tmo)) == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    _peb_rpc_take(h, return_value);
 }
 
 /*
- * Decodes and Erlang term that was send with version magic number
+ * Waits for the replies to several asynchronous RPC requests. The requests
+ * were all sent already, so this takes as long as the slowest of them.
  *
  * Prototype:
- *      mixed peb_vdecode(resource msgbuffer)
+ *      array peb_await_all(array handles [, int timeout])
  *
  * Parameters:
- *      msgbuffer       message
+ *      handles         call handles returned by peb_rpc_async()
+ *      timeout         overall timeout in milliseconds, default is no timeout
  *
  * Return:
- *     array            decodes assoc array
- *     false            decode failure
+ *      array           the messages received under the keys of their
+ *                      handles, false for the calls that failed or timed
+ *                      out; peb_error() tells about the last of these
+ *      false           not an array of call handles
  */
-PHP_FUNCTION(peb_vdecode)
+PHP_FUNCTION(peb_await_all)
 {
+    zval*           handles;
+    zval*           entry;
+    zval            rv;
+    zend_long       tmo = 0, deadline;
+    zend_string*    key;
+    zend_ulong      idx;
+    peb_rpc_handle* h;
+
     PEB_G(error) = NULL;
     PEB_G(errorno) = 0;
 
-    php_peb_decode_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "a|l", &handles, &tmo) == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(handles), entry) {
+        ZVAL_DEREF(entry);
+        if ( Z_TYPE_P(entry) != IS_RESOURCE ||
+                zend_fetch_resource(Z_RES_P(entry), PEB_RPCRESOURCE, le_rpc) == NULL ) {
+            RETURN_FALSE;
+        }
+    } ZEND_HASH_FOREACH_END();
+
+    deadline = _peb_deadline(tmo);
+    array_init_size(return_value, zend_hash_num_elements(Z_ARRVAL_P(handles)));
+
+    ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(handles), idx, key, entry) {
+        ZVAL_DEREF(entry);
+        h = (peb_rpc_handle*) Z_RES_VAL_P(entry);
+
+        if ( _peb_rpc_wait(h, deadline) == SUCCESS ) {
+            _peb_rpc_take(h, &rv);
+        }
+        else {
+            ZVAL_FALSE(&rv);
+        }
+
+        if ( key ) {
+            zend_hash_update(Z_ARRVAL_P(return_value), key, &rv);
+        }
+        else {
+            zend_hash_index_update(Z_ARRVAL_P(return_value), idx, &rv);
+        }
+    } ZEND_HASH_FOREACH_END();
+}
+
+/*
+ * The codec stack is kept per worker and reused by the encoders and the
+ * decoder, it only ever grows up to what peb.max_depth allows.
+ */
+static void* _peb_stack_reserve(size_t size)
+{
+    size_t      n;
+
+    if ( size > PEB_G(stack_size) || PEB_G(stack) == NULL ) {
+        n = MAX(PEB_G(stack_size), PEB_STACK_INITIAL);
+        while ( n < size ) {
+            n *= 2;
+        }
+        PEB_G(stack) = perealloc(PEB_G(stack), n, 1);
+        PEB_G(stack_size) = n;
+    }
+
+    return PEB_G(stack);
+}
+
+/*
+ * Format strings are compiled once into a flat program of opcodes and the
+ * program is cached per worker, keyed by the format string itself.
+ *
+ *  ~a - an atom, char*
+ *  ~s - a string, char*
+ *  ~b - a binary, char*
+ *  ~i - an integer, int
+ *  ~l - a long integer, long int
+ *  ~u - an unsigned long integer, unsigned long int
+ *  ~f - a float, float
+ *  ~d - a double float, double float
+ *  ~p - an erlang pid
+ *  ~P - an erlang pid resource
+ *  [] - an empty list
+ *  [...], {...} - a list or a tuple
+ *  [~x*], {~x*} - a list or a tuple of every element of the array, the
+ *                 repeated term may be a tuple or list itself: [{~a,~i}*]
+ *  #{...} - a map, the data array holds the keys and values in turn
+ *  #{~x*} - a map of every element of the array, string keys are written
+ *           as binaries and integer keys as integers
+ *  #{~a=>~x*} - the same with every key written as ~a, ~s, ~b or ~i
+ *  [~a=>~x*] - a proplist of every element of the array, [{Key, Value}]
+ */
+static peb_fmt_prog* _peb_fmt_compile(const char* fmt, size_t fmt_len, int persistent)
+{
+    const char*     p = fmt;
+    const char*     end = fmt + fmt_len;
+    peb_fmt_op*     ops;
+    uint32_t*       open;
+    uint32_t        len = 0, depth = 0, maxdepth = 0, begin;
+    peb_fmt_prog*   prog = NULL;
+    unsigned char   code, flags;
+    int             after_term = 0;
+
+    /* Every opcode consumes at least one format character */
+    ops = safe_emalloc(fmt_len + 1, sizeof(peb_fmt_op), 0);
+    open = safe_emalloc(fmt_len + 1, sizeof(uint32_t), 0);
+
+    for ( ; p < end; p++ ) {
+        switch ( *p ) {
+            case ' ':
+                continue;
+
+            case ',':
+                after_term = 0;
+                continue;
+
+            case '*':
+                /* Repeats the only term of the enclosing list, tuple or map */
+                if ( !after_term || depth == 0 ) {
+                    goto failure;
+                }
+                begin = open[depth-1];
+                if ( ops[begin].arg != 1 || (ops[begin].flags & PEB_FMT_REPEAT) ) {
+                    goto failure;
+                }
+                ops[begin].flags |= PEB_FMT_REPEAT;
+                after_term = 0;
+                continue;
+
+            case '=':
+                /* #{~a=>~x*} and [~a=>~x*], the key term only selects how keys are written */
+                if ( !after_term || depth == 0 || p + 1 == end || p[1] != '>' ) {
+                    goto failure;
+                }
+                begin = open[depth-1];
+                if ( (ops[begin].code != PEB_OP_MAP && ops[begin].code != PEB_OP_LIST) ||
+                        ops[begin].arg != 1 || len != begin + 2 ) {
+                    goto failure;
+                }
+
+                switch ( ops[len-1].code ) {
+                    case PEB_OP_ATOM: flags = PEB_FMT_KEY_ATOM; break;
+                    case PEB_OP_STRING: flags = PEB_FMT_KEY_STRING; break;
+                    case PEB_OP_BINARY: flags = PEB_FMT_KEY_BINARY; break;
+                    case PEB_OP_LONG: flags = PEB_FMT_KEY_LONG; break;
+                    default:
+                        goto failure;
+                }
+
+                len--;
+                ops[begin].arg = 0;
+                ops[begin].flags |= flags;
+                after_term = 0;
+                p++;
+                continue;
+
+            case '~':
+                do {
+                    ++p;
+                } while ( p < end && *p == ' ' );
+
+                if ( p == end ) {
+                    goto failure;
+                }
+
+                switch ( *p ) {
+                    case 'a': code = PEB_OP_ATOM; break;
+                    case 's': code = PEB_OP_STRING; break;
+                    case 'b': code = PEB_OP_BINARY; break;
+                    case 'i':
+                    case 'l':
+                    case 'u': code = PEB_OP_LONG; break;
+                    case 'f':
+                    case 'd': code = PEB_OP_DOUBLE; break;
+                    case 'p': code = PEB_OP_LINK; break;
+                    case 'P': code = PEB_OP_PID; break;
+                    default:
+                        goto failure;
+                }
+
+                if ( depth > 0 ) {
+                    ops[open[depth-1]].arg++;
+                }
+                ops[len].code = code;
+                ops[len].flags = 0;
+                ops[len].arg = 0;
+                len++;
+                after_term = 1;
+                break;
+
+            case '#':
+            case '[':
+            case '{':
+                if ( *p == '#' ) {
+                    if ( ++p == end || *p != '{' ) {
+                        goto failure;
+                    }
+                    code = PEB_OP_MAP;
+                }
+                else {
+                    code = *p == '[' ? PEB_OP_LIST : PEB_OP_TUPLE;
+                }
+
+                if ( depth > 0 ) {
+                    ops[open[depth-1]].arg++;
+                }
+                ops[len].code = code;
+                ops[len].flags = 0;
+                ops[len].arg = 0;
+                open[depth++] = len++;
+                if ( depth > maxdepth ) {
+                    maxdepth = depth;
+                }
+                after_term = 0;
+                break;
+
+            case ']':
+            case '}':
+                if ( depth == 0 ) {
+                    goto failure;
+                }
+                begin = open[--depth];
+                code = ops[begin].code;
+                flags = ops[begin].flags;
+
+                if ( (*p == ']') != (code == PEB_OP_LIST) ) {
+                    goto failure;
+                }
+
+                if ( (flags & PEB_FMT_REPEAT) && ops[begin].arg != 1 ) {
+                    goto failure;
+                }
+
+                /* Keys come from the array only when it is walked */
+                if ( (flags & PEB_FMT_KEY_MASK) && !(flags & PEB_FMT_REPEAT) ) {
+                    goto failure;
+                }
+
+                /* Fixed maps take key, value pairs */
+                if ( code == PEB_OP_MAP && !(flags & PEB_FMT_REPEAT) && ops[begin].arg % 2 != 0 ) {
+                    goto failure;
+                }
+
+                if ( code == PEB_OP_LIST && ops[begin].arg == 0 ) {
+                    /* Empty list, no data is walked for it */
+                    ops[begin].code = PEB_OP_NIL;
+                    after_term = 1;
+                    break;
+                }
+
+                if ( flags & PEB_FMT_REPEAT ) {
+                    /* The arity comes from the data, keep the jump target instead */
+                    ops[begin].arg = len;
+                }
+
+                if ( code == PEB_OP_LIST ) {
+                    ops[len].code = PEB_OP_LIST_END;
+                }
+                else {
+                    ops[len].code = code == PEB_OP_MAP ? PEB_OP_MAP_END : PEB_OP_TUPLE_END;
+                }
+                ops[len].flags = 0;
+                ops[len].arg = begin;
+                len++;
+                after_term = 1;
+                break;
+
+            default:
+                goto failure;
+        }
+    }
+
+    if ( depth != 0 ) {
+        goto failure;
+    }
+
+    prog = pemalloc(sizeof(peb_fmt_prog) + len * sizeof(peb_fmt_op), persistent);
+    prog->len = len;
+    prog->depth = maxdepth;
+    memcpy(prog->ops, ops, len * sizeof(peb_fmt_op));
+
+failure:
+    efree(open);
+    efree(ops);
+
+    return prog;
+}
+
+/*
+ * Direct ETF writers. Terms are written straight into the output buffer,
+ * which grows geometrically; tuple and list headers are reserved up front
+ * and back-patched with the number of elements actually written.
+ */
+static char* _peb_x_reserve(ei_x_buff* x, size_t n)
+{
+    size_t      need = (size_t) x->index + n;
+    size_t      size;
+    char*       buff;
+
+    if ( need > (size_t) x->buffsz ) {
+        if ( need > INT_MAX ) {
+            return NULL;
+        }
+
+        size = x->buffsz > 0 ? (size_t) x->buffsz : 64;
+        while ( size < need ) {
+            size *= 2;
+        }
+        if ( size > INT_MAX ) {
+            size = INT_MAX;
+        }
+
+        /* ei_x_buff memory is owned by ei, so stay with the libc allocator */
+        if ( (buff=realloc(x->buff, size)) == NULL ) {
+            return NULL;
+        }
+        x->buff = buff;
+        x->buffsz = (int) size;
+    }
+
+    return x->buff + x->index;
+}
+
+static int _peb_x_put_long(ei_x_buff* x, zend_long v)
+{
+    char*       s;
+    uint64_t    u;
+    int         n;
+
+    if ( v >= 0 && v <= 255 ) {
+        if ( (s=_peb_x_reserve(x, 2)) == NULL ) {
+            return FAILURE;
+        }
+        s[0] = ERL_SMALL_INTEGER_EXT;
+        s[1] = (char) v;
+        x->index += 2;
+    }
+    else if ( v >= INT32_MIN && v <= INT32_MAX ) {
+        if ( (s=_peb_x_reserve(x, 5)) == NULL ) {
+            return FAILURE;
+        }
+        s[0] = ERL_INTEGER_EXT;
+        _peb_put32be(s + 1, (uint32_t)(int32_t) v);
+        x->index += 5;
+    }
+    else {
+        if ( (s=_peb_x_reserve(x, 3 + sizeof(uint64_t))) == NULL ) {
+            return FAILURE;
+        }
+        u = v < 0 ? (uint64_t)(-(v + 1)) + 1 : (uint64_t) v;
+        s[0] = ERL_SMALL_BIG_EXT;
+        s[2] = v < 0;
+        for ( n = 0; u != 0; n++, u >>= 8 ) {
+            s[3 + n] = (char)(u & 0xff);
+        }
+        s[1] = (char) n;
+        x->index += 3 + n;
+    }
+
+    return SUCCESS;
+}
+
+static int _peb_x_put_double(ei_x_buff* x, double d)
+{
+    char*       s;
+    uint64_t    u;
+
+    if ( (s=_peb_x_reserve(x, 9)) == NULL ) {
+        return FAILURE;
+    }
+
+    memcpy(&u, &d, sizeof(u));
+    s[0] = NEW_FLOAT_EXT;
+    _peb_put32be(s + 1, (uint32_t)(u >> 32));
+    _peb_put32be(s + 5, (uint32_t) u);
+    x->index += 9;
+
+    return SUCCESS;
+}
+
+/*
+ * Writes a decimal integer of any size as a bignum. The magnitude is built
+ * little-endian after the largest header, four bits per digit is always
+ * enough room, and moved down when SMALL_BIG_EXT fits.
+ */
+static int _peb_x_put_decimal(ei_x_buff* x, const char* digits, size_t len, int negative)
+{
+    size_t          max = len / 2 + 1;
+    size_t          n = 0;
+    size_t          i, j;
+    unsigned char*  mag;
+    unsigned int    carry;
+    char*           s;
+
+    if ( max > UINT32_MAX || (s=_peb_x_reserve(x, 6 + max)) == NULL ) {
+        return FAILURE;
+    }
+    mag = (unsigned char*) s + 6;
+
+    for ( i = 0; i < len; i++ ) {
+        carry = (unsigned int)(digits[i] - '0');
+        for ( j = 0; j < n; j++ ) {
+            carry += mag[j] * 10u;
+            mag[j] = (unsigned char)(carry & 0xff);
+            carry >>= 8;
+        }
+        for ( ; carry != 0; carry >>= 8 ) {
+            mag[n++] = (unsigned char)(carry & 0xff);
+        }
+    }
+
+    if ( n <= 255 ) {
+        s[0] = ERL_SMALL_BIG_EXT;
+        s[1] = (char) n;
+        s[2] = negative != 0;
+        memmove(s + 3, mag, n);
+        x->index += 3 + n;
+    }
+    else {
+        s[0] = ERL_LARGE_BIG_EXT;
+        _peb_put32be(s + 1, (uint32_t) n);
+        s[5] = negative != 0;
+        x->index += 6 + n;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Atoms are given as latin1 (like ei_encode_atom) and written as UTF-8
+ */
+static int _peb_x_put_atom(ei_x_buff* x, const char* p, size_t len)
+{
+    char*       s;
+    int         ulen, latin1;
+    peb_atom*   atom;
+
+    if ( (atom=_peb_atom_get(p, len)) != NULL ) {
+        if ( (s=_peb_x_reserve(x, atom->len)) == NULL ) {
+            return FAILURE;
+        }
+        memcpy(s, atom->ext, atom->len);
+        x->index += atom->len;
+        return SUCCESS;
+    }
+
+    if ( (ulen=_peb_atom_utf8_len(p, len, &latin1)) < 0 ||
+            (s=_peb_x_reserve(x, ulen + 3)) == NULL ) {
+        return FAILURE;
+    }
+
+    x->index += _peb_atom_write(s, p, len, ulen, latin1) - s;
+
+    return SUCCESS;
+}
+
+static int _peb_x_put_binary(ei_x_buff* x, const char* p, size_t len)
+{
+    char*       s;
+
+    if ( len > UINT32_MAX || (s=_peb_x_reserve(x, len + 5)) == NULL ) {
+        return FAILURE;
+    }
+
+    s[0] = ERL_BINARY_EXT;
+    _peb_put32be(s + 1, len);
+    memcpy(s + 5, p, len);
+    x->index += 5 + len;
+
+    return SUCCESS;
+}
+
+/*
+ * Strings follow ei_encode_string_len(): NIL when empty, STRING_EXT up to
+ * 65535 bytes and a list of small integers beyond that
+ */
+static int _peb_x_put_string(ei_x_buff* x, const char* p, size_t len)
+{
+    char*       s;
+    size_t      i;
+
+    if ( len == 0 ) {
+        if ( (s=_peb_x_reserve(x, 1)) == NULL ) {
+            return FAILURE;
+        }
+        s[0] = ERL_NIL_EXT;
+        x->index += 1;
+    }
+    else if ( len <= 0xffff ) {
+        if ( (s=_peb_x_reserve(x, len + 3)) == NULL ) {
+            return FAILURE;
+        }
+        s[0] = ERL_STRING_EXT;
+        _peb_put16be(s + 1, len);
+        memcpy(s + 3, p, len);
+        x->index += 3 + len;
+    }
+    else {
+        if ( len > (INT_MAX - 6) / 2 || (s=_peb_x_reserve(x, 2 * len + 6)) == NULL ) {
+            return FAILURE;
+        }
+        s[0] = ERL_LIST_EXT;
+        _peb_put32be(s + 1, len);
+        s += 5;
+        for ( i = 0; i < len; i++ ) {
+            *s++ = ERL_SMALL_INTEGER_EXT;
+            *s++ = p[i];
+        }
+        *s = ERL_NIL_EXT;
+        x->index += 2 * len + 6;
+    }
+
+    return SUCCESS;
+}
+
+static int _peb_x_put_nil(ei_x_buff* x)
+{
+    char*       s;
+
+    if ( (s=_peb_x_reserve(x, 1)) == NULL ) {
+        return FAILURE;
+    }
+
+    s[0] = ERL_NIL_EXT;
+    x->index += 1;
+
+    return SUCCESS;
+}
+
+/*
+ * Writes the header of a {Key, Value} tuple
+ */
+static int _peb_x_put_pair(ei_x_buff* x)
+{
+    char*       s;
+
+    if ( (s=_peb_x_reserve(x, 2)) == NULL ) {
+        return FAILURE;
+    }
+
+    s[0] = ERL_SMALL_TUPLE_EXT;
+    s[1] = 2;
+    x->index += 2;
+
+    return SUCCESS;
+}
+
+/*
+ * Reserves a tuple or list header and returns its offset, the arity is
+ * filled in later by _peb_x_close(). Small tuples take the two byte form,
+ * so the final arity must not exceed 255 for them.
+ */
+static int _peb_x_open(ei_x_buff* x, char tag)
+{
+    char*       s;
+    int         hdr = x->index;
+    int         size = tag == ERL_SMALL_TUPLE_EXT ? 2 : 5;
+
+    if ( (s=_peb_x_reserve(x, size)) == NULL ) {
+        return -1;
+    }
+
+    s[0] = tag;
+    x->index += size;
+
+    return hdr;
+}
+
+static int _peb_x_close(ei_x_buff* x, int hdr, uint32_t arity)
+{
+    char*       s = x->buff + hdr;
+
+    if ( *s == ERL_SMALL_TUPLE_EXT ) {
+        if ( arity > 255 ) {
+            return FAILURE;
+        }
+        s[1] = (char) arity;
+    }
+    else {
+        _peb_put32be(s + 1, arity);
+    }
+
+    return SUCCESS;
+}
+
+static int _peb_encode_scalar(ei_x_buff* x, unsigned char code, zval* pdata)
+{
+    zend_string*    str;
+    peb_link*       peb;
+    erlang_pid*     ep;
+    int             result;
+
+    switch ( code ) {
+        case PEB_OP_ATOM:
+        case PEB_OP_STRING:
+        case PEB_OP_BINARY:
+            if ( Z_TYPE_P(pdata) == IS_STRING ) {
+                str = Z_STR_P(pdata);
+            }
+            else {
+                str = zval_get_string(pdata);
+            }
+
+            if ( code == PEB_OP_ATOM ) {
+                result = _peb_x_put_atom(x, ZSTR_VAL(str), ZSTR_LEN(str));
+            }
+            else if ( code == PEB_OP_STRING ) {
+                result = _peb_x_put_string(x, ZSTR_VAL(str), ZSTR_LEN(str));
+            }
+            else {
+                result = _peb_x_put_binary(x, ZSTR_VAL(str), ZSTR_LEN(str));
+            }
+
+            if ( Z_TYPE_P(pdata) != IS_STRING ) {
+                zend_string_release(str);
+            }
+            return result;
+
+        case PEB_OP_LONG:
+            return _peb_x_put_long(x, Z_TYPE_P(pdata) == IS_LONG ? Z_LVAL_P(pdata) : zval_get_long(pdata));
+
+        case PEB_OP_DOUBLE:
+            return _peb_x_put_double(x, Z_TYPE_P(pdata) == IS_DOUBLE ? Z_DVAL_P(pdata) : zval_get_double(pdata));
+
+        case PEB_OP_LINK:
+            if ( Z_TYPE_P(pdata) != IS_RESOURCE ||
+                    (peb=(peb_link*)zend_fetch_resource2_ex(pdata, PEB_RESOURCENAME, le_link, le_plink)) == NULL ) {
+                return FAILURE;
+            }
+            return ei_x_encode_pid(x, &(peb->ec->self)) < 0 ? FAILURE : SUCCESS;
+
+        case PEB_OP_PID:
+            if ( Z_TYPE_P(pdata) != IS_RESOURCE ||
+                    (ep=(erlang_pid*)zend_fetch_resource_ex(pdata, PEB_SERVERPID, le_serverpid)) == NULL ) {
+                return FAILURE;
+            }
+            return ei_x_encode_pid(x, ep) < 0 ? FAILURE : SUCCESS;
+    }
+
+    return FAILURE;
+}
+
+/*
+ * How a repeated container writes the keys of its array, 0 for none
+ */
+static int _peb_fmt_keys(const peb_fmt_op* op)
+{
+    if ( op->code == PEB_OP_MAP ) {
+        return (op->flags & PEB_FMT_KEY_MASK) ? (op->flags & PEB_FMT_KEY_MASK) : PEB_FMT_KEY_AUTO;
+    }
+
+    if ( op->code == PEB_OP_LIST && (op->flags & PEB_FMT_KEY_MASK) ) {
+        return (op->flags & PEB_FMT_KEY_MASK) | PEB_FMT_KEY_PAIR;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes the key at pos of a repeated map or proplist, keys follow the PHP
+ * array unless the format gives them a type. Proplist entries also get the
+ * header of their {Key, Value} tuple.
+ */
+static int _peb_encode_key(ei_x_buff* x, int keys, HashTable* arr, HashPosition* pos)
+{
+    zend_string*    str;
+    zend_ulong      idx;
+    zval            key;
+    int             result;
+
+    if ( keys & PEB_FMT_KEY_PAIR ) {
+        if ( _peb_x_put_pair(x) != SUCCESS ) {
+            return FAILURE;
+        }
+        keys &= ~PEB_FMT_KEY_PAIR;
+    }
+
+    if ( keys == PEB_FMT_KEY_AUTO ) {
+        if ( zend_hash_get_current_key_ex(arr, &str, &idx, pos) == HASH_KEY_IS_STRING ) {
+            return _peb_x_put_binary(x, ZSTR_VAL(str), ZSTR_LEN(str));
+        }
+        return _peb_x_put_long(x, (zend_long) idx);
+    }
+
+    zend_hash_get_current_key_zval_ex(arr, &key, pos);
+
+    switch ( keys ) {
+        case PEB_FMT_KEY_ATOM:
+            result = _peb_encode_scalar(x, PEB_OP_ATOM, &key);
+            break;
+        case PEB_FMT_KEY_STRING:
+            result = _peb_encode_scalar(x, PEB_OP_STRING, &key);
+            break;
+        case PEB_FMT_KEY_BINARY:
+            result = _peb_encode_scalar(x, PEB_OP_BINARY, &key);
+            break;
+        default:
+            result = _peb_encode_scalar(x, PEB_OP_LONG, &key);
+            break;
+    }
+
+    zval_ptr_dtor(&key);
+
+    return result;
+}
+
+/*
+ * Encodes every element of arr with a single scalar opcode, used for
+ * repeated lists, tuples and maps such as [~i*]
+ */
+static int _peb_encode_repeat(ei_x_buff* x, const peb_fmt_op* op, unsigned char body, HashTable* arr)
+{
+    uint32_t        count = zend_hash_num_elements(arr);
+    HashPosition    pos;
+    zval*           pdata;
+    int             hdr, keys = _peb_fmt_keys(op);
+
+    if ( op->code == PEB_OP_LIST ) {
+        hdr = _peb_x_open(x, ERL_LIST_EXT);
+    }
+    else if ( op->code == PEB_OP_MAP ) {
+        hdr = _peb_x_open(x, ERL_MAP_EXT);
+    }
+    else {
+        hdr = _peb_x_open(x, count <= 255 ? ERL_SMALL_TUPLE_EXT : ERL_LARGE_TUPLE_EXT);
+    }
+
+    if ( hdr < 0 || _peb_x_close(x, hdr, count) != SUCCESS ) {
+        return FAILURE;
+    }
+
+    /* Fixed size terms, grow the buffer once for the whole array */
+    if ( (body == PEB_OP_LONG || body == PEB_OP_DOUBLE) && keys == 0 &&
+            (count > INT_MAX / 11 || _peb_x_reserve(x, count * 11) == NULL) ) {
+        return FAILURE;
+    }
+
+    if ( keys ) {
+        zend_hash_internal_pointer_reset_ex(arr, &pos);
+        while ( (pdata=zend_hash_get_current_data_ex(arr, &pos)) != NULL ) {
+            ZVAL_DEREF(pdata);
+            if ( _peb_encode_key(x, keys, arr, &pos) != SUCCESS ||
+                    _peb_encode_scalar(x, body, pdata) != SUCCESS ) {
+                return FAILURE;
+            }
+            zend_hash_move_forward_ex(arr, &pos);
+        }
+    }
+    else {
+        ZEND_HASH_FOREACH_VAL(arr, pdata) {
+            ZVAL_DEREF(pdata);
+            if ( _peb_encode_scalar(x, body, pdata) != SUCCESS ) {
+                return FAILURE;
+            }
+        } ZEND_HASH_FOREACH_END();
+    }
+
+    return op->code == PEB_OP_LIST ? _peb_x_put_nil(x) : SUCCESS;
+}
+
+/*
+ * Runs a compiled format program over the data array in a single pass.
+ * Tuples and lists switch the data cursor to the nested array, the previous
+ * cursor is kept on the codec stack sized by the program's nesting depth.
+ * Repeated containers walk their array in order and jump back to the start
+ * of their body for every element, repeated maps write the key of the
+ * element before its value.
+ */
+static int _peb_encode(ei_x_buff* x, const peb_fmt_prog* prog, HashTable* arr)
+{
+    peb_enc_frame*      stack;
+    peb_enc_frame*      frame;
+    uint32_t            sp = 0, count;
+    zend_long           arridx = 0;
+    const peb_fmt_op*   op = prog->ops;
+    const peb_fmt_op*   end = prog->ops + prog->len;
+    const peb_fmt_op*   body;
+    HashTable*          child;
+    zval*               pdata;
+    char                tag;
+    int                 result = SUCCESS;
+
+    if ( prog->depth > PEB_G(max_depth) ) {
+        PEB_G(errorno) = PEB_ERRORNO_DEPTH;
+        PEB_G(error) = estrdup(PEB_ERROR_DEPTH);
+        return FAILURE;
+    }
+
+    stack = _peb_stack_reserve(prog->depth * sizeof(peb_enc_frame));
+
+    for ( ; op < end && result == SUCCESS; op++ ) {
+        if ( op->code == PEB_OP_LIST_END || op->code == PEB_OP_TUPLE_END || op->code == PEB_OP_MAP_END ) {
+            frame = &stack[sp-1];
+            if ( frame->repeat && zend_hash_get_current_data_ex(arr, &frame->pos) != NULL ) {
+                /* Next element, run the body again */
+                op = prog->ops + op->arg;
+                continue;
+            }
+
+            sp--;
+            if ( op->code == PEB_OP_LIST_END ) {
+                result = _peb_x_put_nil(x);
+            }
+            if ( result == SUCCESS ) {
+                /* Fixed maps take a key and a value from the data per entry */
+                count = op->code == PEB_OP_MAP_END && !frame->repeat ? frame->count / 2 : frame->count;
+                result = _peb_x_close(x, frame->hdr, count);
+            }
+            arr = frame->arr;
+            arridx = frame->idx;
+            continue;
+        }
+
+        if ( sp > 0 && stack[sp-1].repeat ) {
+            if ( stack[sp-1].keys && _peb_encode_key(x, stack[sp-1].keys, arr, &stack[sp-1].pos) != SUCCESS ) {
+                result = FAILURE;
+                continue;
+            }
+            pdata = zend_hash_get_current_data_ex(arr, &stack[sp-1].pos);
+            zend_hash_move_forward_ex(arr, &stack[sp-1].pos);
+        }
+        else {
+            pdata = zend_hash_index_find(arr, arridx++);
+        }
+
+        if ( sp > 0 ) {
+            stack[sp-1].count++;
+        }
+
+        if ( op->code == PEB_OP_NIL ) {
+            result = _peb_x_put_nil(x);
+            continue;
+        }
+
+        if ( pdata == NULL ) {
+            result = FAILURE;
+            continue;
+        }
+        ZVAL_DEREF(pdata);
+
+        if ( op->code < PEB_OP_NIL ) {
+            result = _peb_encode_scalar(x, op->code, pdata);
+            continue;
+        }
+
+        if ( Z_TYPE_P(pdata) != IS_ARRAY ) {
+            result = FAILURE;
+            continue;
+        }
+        child = Z_ARRVAL_P(pdata);
+
+        if ( op->flags & PEB_FMT_REPEAT ) {
+            count = zend_hash_num_elements(child);
+            body = op + 1;
+
+            if ( count == 0 || (body->code < PEB_OP_NIL && body + 1 == prog->ops + op->arg) ) {
+                /* Nothing to walk or a single scalar body, no frame needed */
+                result = _peb_encode_repeat(x, op, body->code, child);
+                op = prog->ops + op->arg;
+                continue;
+            }
+        }
+        else {
+            count = op->arg;
+        }
+
+        if ( op->code == PEB_OP_LIST ) {
+            tag = ERL_LIST_EXT;
+        }
+        else if ( op->code == PEB_OP_MAP ) {
+            tag = ERL_MAP_EXT;
+        }
+        else {
+            tag = count <= 255 ? ERL_SMALL_TUPLE_EXT : ERL_LARGE_TUPLE_EXT;
+        }
+
+        frame = &stack[sp++];
+        frame->arr = arr;
+        frame->idx = arridx;
+        frame->count = 0;
+        frame->repeat = op->flags & PEB_FMT_REPEAT;
+        frame->keys = frame->repeat ? _peb_fmt_keys(op) : 0;
+        if ( frame->repeat ) {
+            zend_hash_internal_pointer_reset_ex(child, &frame->pos);
+        }
+
+        if ( (frame->hdr=_peb_x_open(x, tag)) < 0 ) {
+            result = FAILURE;
+        }
+
+        arr = child;
+        arridx = 0;
+    }
+
+    return result;
+}
+
+static void php_peb_encode_impl(INTERNAL_FUNCTION_PARAMETERS, int with_version)
+{
+    char*           fmt;
+    size_t          fmt_len;
+    int             cached = 1;
+
+    zval*           tmp;
+    ei_x_buff*      x;
+    HashTable*      htable;
+    peb_fmt_prog*   prog;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "sa", &fmt, &fmt_len, &tmp) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    /* find hashtable for array */
+    ZVAL_DEREF(tmp);
+    htable = Z_ARRVAL_P(tmp);
+
+    if ( (prog=zend_hash_str_find_ptr(&PEB_G(fmt_cache), fmt, fmt_len)) == NULL ) {
+        cached = zend_hash_num_elements(&PEB_G(fmt_cache)) < PEB_FMT_CACHE_SIZE;
+
+        if ( (prog=_peb_fmt_compile(fmt, fmt_len, cached)) == NULL ) {
+            PEB_G(errorno) = PEB_ERRORNO_FORMAT;
+            PEB_G(error) = estrdup(PEB_ERROR_FORMAT);
+            RETURN_FALSE;
+        }
+
+        if ( cached ) {
+            zend_hash_str_add_ptr(&PEB_G(fmt_cache), fmt, fmt_len, prog);
+        }
+    }
+
+    x = emalloc(sizeof(ei_x_buff));
+    if ( with_version ) {
+        ei_x_new_with_version(x);
+    }
+    else {
+        ei_x_new(x);
+    }
+
+    if ( _peb_encode(x, prog, htable) != SUCCESS ) {
+        if ( PEB_G(errorno) == 0 ) {
+            PEB_G(errorno) = PEB_ERRORNO_ENCODE;
+            PEB_G(error) = estrdup(PEB_ERROR_ENCODE);
+        }
+        ei_x_free(x);
+        efree(x);
+        RETVAL_FALSE;
+    }
+    else {
+        RETVAL_RES(zend_register_resource(x, le_msgbuff));
+    }
+
+    if ( !cached ) {
+        efree(prog);
+    }
+}
+
+/*
+ * Encodes the PHP variables to Erlang terms according to the specified format
+ * with version number
+ *
+ * Prototype:
+ *      resource peb_vencode(string format, array data)
+ *
+ * Parameters:
+ *      format          format string
+ *      data            array data to formatting
+ *
+ * Return:
+ *     messageid        success
+ *     false            failure
+ */
+PHP_FUNCTION(peb_vencode)
+{
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    php_peb_encode_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
+}
+
+/*
+ * Encodes the PHP variables to Erlang terms according to the specified format
+ * without version number
+ *
+ * Prototype:
+ *      resource peb_encode(string format, array data)
+ *
+ * Parameters:
+ *      format          format string
+ *      data            array data to formatting
+ *
+ * Return:
+ *     messageid        success
+ *     false            failure
+ */
+PHP_FUNCTION(peb_encode)
+{
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    php_peb_encode_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
+}
+
+static int _peb_array_is_list(HashTable* ht)
+{
+    zend_string*    key;
+    zend_ulong      idx, expected = 0;
+
+    if ( HT_IS_PACKED(ht) && HT_IS_WITHOUT_HOLES(ht) ) {
+        return 1;
+    }
+
+    ZEND_HASH_FOREACH_KEY(ht, idx, key) {
+        if ( key != NULL || idx != expected++ ) {
+            return 0;
+        }
+    } ZEND_HASH_FOREACH_END();
+
+    return 1;
+}
+
+/*
+ * Appends an already encoded term resource, dropping its version magic
+ */
+static int _peb_x_put_term(ei_x_buff* x, const ei_x_buff* term)
+{
+    const char*     p = term->buff;
+    int             len = term->index;
+    char*           s;
+
+    if ( len > 0 && (unsigned char) p[0] == ERL_VERSION_MAGIC ) {
+        ++p;
+        --len;
+    }
+
+    if ( len <= 0 || (s=_peb_x_reserve(x, len)) == NULL ) {
+        return FAILURE;
+    }
+
+    memcpy(s, p, len);
+    x->index += len;
+
+    return SUCCESS;
+}
+
+/*
+ * Encodes a PHP value without a format string:
+ *
+ *  int             integer
+ *  float           float
+ *  string          binary
+ *  true, false     atoms true and false
+ *  null            atom undefined
+ *  list array      list (an empty array is an empty list)
+ *  other array     map, string keys become binaries
+ *  pid resource    pid
+ *  link resource   self pid of the link
+ *  term resource   the encoded term itself
+ *
+ * Arrays are walked iteratively on the codec stack.
+ */
+static int _peb_encode_value(ei_x_buff* x, zval* value, int flags)
+{
+    peb_val_frame*  stack = _peb_stack_reserve(0);
+    peb_val_frame*  frame;
+    uint32_t        sp = 0, count;
+    zval*           zv = value;
+    zend_string*    key;
+    zend_ulong      idx;
+    HashTable*      ht;
+    peb_link*       peb;
+    erlang_pid*     ep;
+    ei_x_buff*      term;
+    int             hdr;
+    int             result = SUCCESS;
+
+    while ( result == SUCCESS ) {
+        ZVAL_DEREF(zv);
+
+        switch ( Z_TYPE_P(zv) ) {
+            case IS_LONG:
+                result = _peb_x_put_long(x, Z_LVAL_P(zv));
+                break;
+
+            case IS_DOUBLE:
+                result = _peb_x_put_double(x, Z_DVAL_P(zv));
+                break;
+
+            case IS_STRING:
+                result = _peb_x_put_binary(x, Z_STRVAL_P(zv), Z_STRLEN_P(zv));
+                break;
+
+            case IS_TRUE:
+                result = _peb_x_put_atom(x, "true", sizeof("true") - 1);
+                break;
+
+            case IS_FALSE:
+                result = _peb_x_put_atom(x, "false", sizeof("false") - 1);
+                break;
+
+            case IS_NULL:
+                result = _peb_x_put_atom(x, "undefined", sizeof("undefined") - 1);
+                break;
+
+            case IS_RESOURCE:
+                if ( Z_RES_TYPE_P(zv) == le_serverpid ) {
+                    ep = (erlang_pid*) Z_RES_VAL_P(zv);
+                    result = ei_x_encode_pid(x, ep) < 0 ? FAILURE : SUCCESS;
+                }
+                else if ( Z_RES_TYPE_P(zv) == le_link || Z_RES_TYPE_P(zv) == le_plink ) {
+                    peb = (peb_link*) Z_RES_VAL_P(zv);
+                    result = ei_x_encode_pid(x, &(peb->ec->self)) < 0 ? FAILURE : SUCCESS;
+                }
+                else if ( Z_RES_TYPE_P(zv) == le_msgbuff ) {
+                    term = (ei_x_buff*) Z_RES_VAL_P(zv);
+                    result = _peb_x_put_term(x, term);
+                }
+                else {
+                    result = FAILURE;
+                }
+                break;
+
+            case IS_ARRAY:
+                ht = Z_ARRVAL_P(zv);
+                if ( (count=zend_hash_num_elements(ht)) == 0 ) {
+                    result = _peb_x_put_nil(x);
+                    break;
+                }
+
+                if ( sp >= PEB_G(max_depth) ) {
+                    PEB_G(errorno) = PEB_ERRORNO_DEPTH;
+                    PEB_G(error) = estrdup(PEB_ERROR_DEPTH);
+                    result = FAILURE;
+                    break;
+                }
+
+                stack = _peb_stack_reserve((sp + 1) * sizeof(peb_val_frame));
+
+                frame = &stack[sp++];
+                frame->ht = ht;
+                frame->is_map = !_peb_array_is_list(ht);
+                frame->is_proplist = frame->is_map && (flags & PEB_OPT_PROPLISTS);
+                zend_hash_internal_pointer_reset_ex(ht, &frame->pos);
+
+                if ( (hdr=_peb_x_open(x, frame->is_map && !frame->is_proplist ? ERL_MAP_EXT : ERL_LIST_EXT)) < 0 ) {
+                    result = FAILURE;
+                }
+                else {
+                    result = _peb_x_close(x, hdr, count);
+                }
+                break;
+
+            default:
+                result = FAILURE;
+                break;
+        }
+
+        /* Move to the next element of the innermost unfinished array */
+        zv = NULL;
+        while ( result == SUCCESS && sp > 0 ) {
+            frame = &stack[sp-1];
+
+            if ( (zv=zend_hash_get_current_data_ex(frame->ht, &frame->pos)) != NULL ) {
+                if ( frame->is_proplist && _peb_x_put_pair(x) != SUCCESS ) {
+                    result = FAILURE;
+                    break;
+                }
+                if ( frame->is_map ) {
+                    if ( zend_hash_get_current_key_ex(frame->ht, &key, &idx, &frame->pos) != HASH_KEY_IS_STRING ) {
+                        result = _peb_x_put_long(x, (zend_long) idx);
+                    }
+                    else if ( flags & PEB_OPT_ATOM_KEYS ) {
+                        result = _peb_x_put_atom(x, ZSTR_VAL(key), ZSTR_LEN(key));
+                    }
+                    else {
+                        result = _peb_x_put_binary(x, ZSTR_VAL(key), ZSTR_LEN(key));
+                    }
+                }
+                zend_hash_move_forward_ex(frame->ht, &frame->pos);
+                break;
+            }
+
+            if ( !frame->is_map || frame->is_proplist ) {
+                result = _peb_x_put_nil(x);
+            }
+            sp--;
+        }
+
+        if ( zv == NULL ) {
+            break;
+        }
+    }
+
+    return result;
+}
+
+static void php_peb_encode_value_impl(INTERNAL_FUNCTION_PARAMETERS, int with_version)
+{
+    zval*           value;
+    zend_long       flags = 0;
+    ei_x_buff*      x;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "z|l", &value, &flags) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    x = emalloc(sizeof(ei_x_buff));
+    if ( with_version ) {
+        ei_x_new_with_version(x);
+    }
+    else {
+        ei_x_new(x);
+    }
+
+    if ( _peb_encode_value(x, value, (int) flags) != SUCCESS ) {
+        if ( PEB_G(errorno) == 0 ) {
+            PEB_G(errorno) = PEB_ERRORNO_ENCODE;
+            PEB_G(error) = estrdup(PEB_ERROR_ENCODE);
+        }
+        ei_x_free(x);
+        efree(x);
+        RETURN_FALSE;
+    }
+
+    RETVAL_RES(zend_register_resource(x, le_msgbuff));
+}
+
+/*
+ * Encodes a PHP value to an Erlang term by its type, without format string
+ * and without version number
+ *
+ * Prototype:
+ *      resource peb_encode_value(mixed value [, int options])
+ *
+ * Parameters:
+ *      value           int, float, string, bool, null, array, pid, link
+ *                      or term resource
+ *      options         PEB_PROPLISTS to write assoc arrays as [{Key, Value}]
+ *                      instead of maps, PEB_ATOM_KEYS to write their string
+ *                      keys as atoms instead of binaries
+ *
+ * Return:
+ *     messageid        success
+ *     false            failure
+ */
+PHP_FUNCTION(peb_encode_value)
+{
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    php_peb_encode_value_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
+}
+
+/*
+ * Encodes a PHP value to an Erlang term by its type, without format string
+ * and with version number
+ *
+ * Prototype:
+ *      resource peb_vencode_value(mixed value [, int options])
+ *
+ * Parameters:
+ *      value           int, float, string, bool, null, array, pid, link
+ *                      or term resource
+ *      options         PEB_PROPLISTS to write assoc arrays as [{Key, Value}]
+ *                      instead of maps, PEB_ATOM_KEYS to write their string
+ *                      keys as atoms instead of binaries
+ *
+ * Return:
+ *     messageid        success
+ *     false            failure
+ */
+PHP_FUNCTION(peb_vencode_value)
+{
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    php_peb_encode_value_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
+}
+
+/*
+ * Tuples and lists are decoded into packed arrays allocated for their known
+ * arity and filled in place, so they never grow or get rehashed
+ */
+static void _peb_array_init_packed(zval* arr, uint32_t size)
+{
+    array_init_size(arr, size);
+    zend_hash_real_init(Z_ARRVAL_P(arr), 1);
+}
+
+static zend_always_inline void _peb_array_append(zval* arr, zval* z)
+{
+    ZEND_HASH_FILL_PACKED(Z_ARRVAL_P(arr)) {
+        ZEND_HASH_FILL_ADD(z);
+    } ZEND_HASH_FILL_END();
+}
+
+/*
+ * Decodes the atom at x->index. Atoms already in the atom table are found
+ * by their encoded bytes and returned as the interned name, without any
+ * allocation; others are decoded once and added to the table.
+ */
+static zend_string* _peb_decode_atom(ei_x_buff* x, int size)
+{
+    const char*     wire = x->buff + x->index;
+    int             hdr, wire_len;
+    peb_atom*       atom;
+    zend_string*    name;
+
+    hdr = *wire == ERL_SMALL_ATOM_EXT || *wire == ERL_SMALL_ATOM_UTF8_EXT ? 2 : 3;
+    wire_len = hdr + size;
+    if ( size < 0 || wire_len > x->buffsz - x->index ) {
+        return NULL;
+    }
+
+    if ( (atom=zend_hash_str_find_ptr(&PEB_G(atom_wire), wire, wire_len)) != NULL ) {
+        x->index += wire_len;
+        return atom->name;
+    }
+
+    /* Names are UTF-8 whatever the atom was sent as */
+    if ( *wire == ERL_ATOM_UTF8_EXT || *wire == ERL_SMALL_ATOM_UTF8_EXT ) {
+        name = zend_string_init(wire + hdr, size, 0);
+    }
+    else {
+        name = _peb_latin1_to_utf8((const unsigned char*) wire + hdr, size);
+    }
+    x->index += wire_len;
+
+    if ( (atom=_peb_atom_get(ZSTR_VAL(name), ZSTR_LEN(name))) != NULL ) {
+        zend_hash_str_add_ptr(&PEB_G(atom_wire), wire, wire_len, atom);
+        zend_string_release(name);
+        name = atom->name;
+    }
+
+    return name;
+}
+
+/*
+ * Decodes a map key into an array key. Integers stay integer keys, atoms,
+ * strings and binaries become string keys with the usual numeric string
+ * handling of PHP arrays left to zend_symtable_update().
+ */
+static int _peb_decode_key(ei_x_buff* x, peb_dec_frame* frame)
+{
+    int         type, size, hdr;
+    long        long_value;
+
+    if ( ei_get_type(x->buff, &x->index, &type, &size) < 0 ) {
+        return FAILURE;
+    }
+
+    switch ( type ) {
+        case ERL_SMALL_INTEGER_EXT:
+        case ERL_INTEGER_EXT:
+        case ERL_SMALL_BIG_EXT:
+            if ( ei_decode_long(x->buff, &x->index, &long_value) < 0 ) {
+                return FAILURE;
+            }
+            frame->key = NULL;
+            frame->idx = (zend_ulong) long_value;
+            break;
+
+        case ERL_ATOM_EXT:
+            if ( (frame->key=_peb_decode_atom(x, size)) == NULL ) {
+                return FAILURE;
+            }
+            break;
+
+        case ERL_STRING_EXT:
+        case ERL_BINARY_EXT:
+            hdr = type == ERL_STRING_EXT ? 3 : 5;
+            if ( size < 0 || size > x->buffsz - x->index - hdr ) {
+                return FAILURE;
+            }
+            frame->key = zend_string_init(x->buff + x->index + hdr, size, 0);
+            x->index += hdr + size;
+            break;
+
+        default:
+            /* Tuples, pids and the like have no array key equivalent */
+            return FAILURE;
+    }
+
+    frame->has_key = 1;
+
+    return SUCCESS;
+}
+
+/*
+ * Checks that the list at index only holds {Key, Value} tuples with keys
+ * that make array keys, the terms are skipped without being decoded. Only
+ * the JSON writer needs this, its output cannot be taken back once written.
+ */
+static int _peb_is_proplist(const char* buff, int index)
+{
+    int         type, size, arity, key;
+    long        long_value;
+
+    if ( ei_decode_list_header(buff, &index, &size) < 0 ) {
+        return 0;
+    }
+
+    while ( size > 0 ) {
+        for ( ; size > 0; size-- ) {
+            if ( ei_decode_tuple_header(buff, &index, &arity) < 0 || arity != 2 ||
+                    ei_get_type(buff, &index, &type, &arity) < 0 ) {
+                return 0;
+            }
+
+            switch ( type ) {
+                case ERL_ATOM_EXT:
+                case ERL_STRING_EXT:
+                case ERL_BINARY_EXT:
+                case ERL_SMALL_INTEGER_EXT:
+                case ERL_INTEGER_EXT:
+                    break;
+                case ERL_SMALL_BIG_EXT:
+                    /* Only bignums that fit a long make array keys */
+                    key = index;
+                    if ( ei_decode_long(buff, &key, &long_value) < 0 ) {
+                        return 0;
+                    }
+                    break;
+                default:
+                    return 0;
+            }
+
+            if ( ei_skip_term(buff, &index) < 0 || ei_skip_term(buff, &index) < 0 ) {
+                return 0;
+            }
+        }
+
+        /* The tail is either [] or a continuation of the list */
+        if ( ei_decode_list_header(buff, &index, &size) < 0 ) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static zend_always_inline uint32_t _peb_popcount16(uint32_t m)
+{
+    m = m - ((m >> 1) & 0x5555);
+    m = (m & 0x3333) + ((m >> 2) & 0x3333);
+    m = (m + (m >> 4)) & 0x0f0f;
+
+    return (m + (m >> 8)) & 0x1f;
+}
+
+static zend_always_inline char* _peb_put_utf8(char* d, uint32_t cp)
+{
+    if ( cp < 0x80 ) {
+        *d++ = (char) cp;
+    }
+    else if ( cp < 0x800 ) {
+        *d++ = (char) (0xc0 | (cp >> 6));
+        *d++ = (char) (0x80 | (cp & 0x3f));
+    }
+    else if ( cp < 0x10000 ) {
+        *d++ = (char) (0xe0 | (cp >> 12));
+        *d++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+        *d++ = (char) (0x80 | (cp & 0x3f));
+    }
+    else {
+        *d++ = (char) (0xf0 | (cp >> 18));
+        *d++ = (char) (0x80 | ((cp >> 12) & 0x3f));
+        *d++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+        *d++ = (char) (0x80 | (cp & 0x3f));
+    }
+
+    return d;
+}
+
+/*
+ * Latin-1 bytes of a STRING_EXT to a UTF-8 string, the bytes that need two
+ * UTF-8 bytes are counted 16 at a time where SSE2 is available
+ */
+static zend_string* _peb_latin1_to_utf8(const unsigned char* p, size_t n)
+{
+    zend_string*    str;
+    char*           d;
+    size_t          i = 0, high = 0;
+
+#ifdef __SSE2__
+    for ( ; i + 16 <= n; i += 16 ) {
+        high += _peb_popcount16(_mm_movemask_epi8(_mm_loadu_si128((const __m128i*) (p + i))));
+    }
+#endif
+    for ( ; i < n; i++ ) {
+        high += p[i] >> 7;
+    }
+
+    if ( high == 0 ) {
+        return zend_string_init((const char*) p, n, 0);
+    }
+
+    str = zend_string_alloc(n + high, 0);
+    d = ZSTR_VAL(str);
+    for ( i = 0; i < n; i++ ) {
+        d = _peb_put_utf8(d, p[i]);
+    }
+    *d = '\0';
+
+    return str;
+}
+
+/*
+ * Decodes a proper list of code points into one UTF-8 string. Erlang sends
+ * strings that are too long or not Latin-1 this way, as SMALL_INTEGER_EXT
+ * and INTEGER_EXT elements. The first pass validates the list and sizes the
+ * string, runs of small integers are checked 8 at a time where SSE2 is
+ * available. Nothing is consumed when the list is not a charlist.
+ */
+static int _peb_decode_charlist(ei_x_buff* x, zval* rv)
+{
+    const unsigned char*    s = (const unsigned char*) x->buff + x->index;
+    const unsigned char*    end = (const unsigned char*) x->buff + x->buffsz;
+    const unsigned char*    p;
+    zend_string*            str;
+    char*                   d;
+    uint32_t                i, n, cp;
+    size_t                  len = 0;
+#ifdef __SSE2__
+    const __m128i           even = _mm_set1_epi16(0x00ff);
+    const __m128i           tags = _mm_set1_epi16(ERL_SMALL_INTEGER_EXT);
+    __m128i                 v;
+    uint32_t                m;
+#endif
+
+    if ( end - s < 6 || s[0] != ERL_LIST_EXT ) {
+        return FAILURE;
+    }
+
+    n = _peb_get32be(s + 1);
+    p = s + 5;
+    if ( n > (size_t) (end - p) / 2 ) {
+        return FAILURE;
+    }
+
+    for ( i = 0; i < n; i++ ) {
+#ifdef __SSE2__
+        while ( n - i >= 8 && end - p >= 16 ) {
+            v = _mm_loadu_si128((const __m128i*) p);
+            if ( _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, even), tags)) != 0xffff ) {
+                break;
+            }
+            /* Values of 0x80 and up take two UTF-8 bytes */
+            m = _mm_movemask_epi8(v) & 0xaaaa;
+            len += 8 + _peb_popcount16(m);
+            p += 16;
+            i += 8;
+        }
+        if ( i == n ) {
+            break;
+        }
+#endif
+        if ( end - p >= 2 && p[0] == ERL_SMALL_INTEGER_EXT ) {
+            len += 1 + (p[1] >> 7);
+            p += 2;
+        }
+        else if ( end - p >= 5 && p[0] == ERL_INTEGER_EXT ) {
+            cp = _peb_get32be(p + 1);
+            if ( cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff) ) {
+                return FAILURE;
+            }
+            len += cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+            p += 5;
+        }
+        else {
+            return FAILURE;
+        }
+    }
+
+    if ( p >= end || *p != ERL_NIL_EXT ) {
+        return FAILURE;
+    }
+
+    str = zend_string_alloc(len, 0);
+    d = ZSTR_VAL(str);
+
+    for ( p = s + 5, i = 0; i < n; i++ ) {
+#ifdef __SSE2__
+        /* ASCII runs, the value bytes of 8 elements are packed together */
+        while ( n - i >= 8 ) {
+            v = _mm_loadu_si128((const __m128i*) p);
+            if ( _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, even), tags)) != 0xffff ||
+                    (_mm_movemask_epi8(v) & 0xaaaa) != 0 ) {
+                break;
+            }
+            v = _mm_srli_epi16(v, 8);
+            _mm_storel_epi64((__m128i*) d, _mm_packus_epi16(v, v));
+            d += 8;
+            p += 16;
+            i += 8;
+        }
+        if ( i == n ) {
+            break;
+        }
+#endif
+        if ( p[0] == ERL_SMALL_INTEGER_EXT ) {
+            d = _peb_put_utf8(d, p[1]);
+            p += 2;
+        }
+        else {
+            d = _peb_put_utf8(d, _peb_get32be(p + 1));
+            p += 5;
+        }
+    }
+    *d = '\0';
+
+    x->index = (int) (p + 1 - (const unsigned char*) x->buff);
+    ZVAL_NEW_STR(rv, str);
+
+    return SUCCESS;
+}
+
+static void _peb_decode_add(peb_dec_frame* frame, zval* z)
+{
+    if ( !frame->is_map ) {
+        _peb_array_append(&frame->arr, z);
+        return;
+    }
+
+    if ( frame->is_proplist &&
+            (frame->key != NULL ? zend_symtable_find(Z_ARRVAL(frame->arr), frame->key)
+                                : zend_hash_index_find(Z_ARRVAL(frame->arr), frame->idx)) != NULL ) {
+        /* Like proplists:get_value/2, the first occurrence of a key wins */
+        zval_ptr_dtor(z);
+    }
+    else if ( frame->key != NULL ) {
+        zend_symtable_update(Z_ARRVAL(frame->arr), frame->key, z);
+    }
+    else {
+        zend_hash_index_update(Z_ARRVAL(frame->arr), frame->idx, z);
+    }
+
+    if ( frame->key != NULL ) {
+        zend_string_release(frame->key);
+        frame->key = NULL;
+    }
+    frame->has_key = 0;
+}
+
+static const unsigned char peb_term_class[256] = {
+    [ERL_SMALL_INTEGER_EXT]     = PEB_T_SMALL_INT,
+    [ERL_INTEGER_EXT]           = PEB_T_INT,
+    [NEW_FLOAT_EXT]             = PEB_T_NEW_FLOAT,
+    [ERL_FLOAT_EXT]             = PEB_T_FLOAT,
+    [ERL_ATOM_EXT]              = PEB_T_ATOM,
+    [ERL_SMALL_ATOM_EXT]        = PEB_T_ATOM,
+    [ERL_ATOM_UTF8_EXT]         = PEB_T_ATOM,
+    [ERL_SMALL_ATOM_UTF8_EXT]   = PEB_T_ATOM,
+    [ERL_STRING_EXT]            = PEB_T_STRING,
+    [ERL_BINARY_EXT]            = PEB_T_BINARY,
+    [ERL_SMALL_BIG_EXT]         = PEB_T_BIG,
+    [ERL_LARGE_BIG_EXT]         = PEB_T_BIG,
+    [ERL_PID_EXT]               = PEB_T_PID,
+    [ERL_NEW_PID_EXT]           = PEB_T_PID,
+    [ERL_SMALL_TUPLE_EXT]       = PEB_T_TUPLE,
+    [ERL_LARGE_TUPLE_EXT]       = PEB_T_TUPLE,
+    [ERL_NIL_EXT]               = PEB_T_NIL,
+    [ERL_LIST_EXT]              = PEB_T_LIST,
+    [ERL_MAP_EXT]               = PEB_T_MAP,
+    [ERL_REFERENCE_EXT]         = PEB_T_OPAQUE,
+    [ERL_NEW_REFERENCE_EXT]     = PEB_T_OPAQUE,
+    [ERL_NEWER_REFERENCE_EXT]   = PEB_T_OPAQUE,
+    [ERL_PORT_EXT]              = PEB_T_OPAQUE,
+    [ERL_NEW_PORT_EXT]          = PEB_T_OPAQUE,
+    [ERL_V4_PORT_EXT]           = PEB_T_OPAQUE,
+    [ERL_NEW_FUN_EXT]           = PEB_T_OPAQUE,
+    [ERL_FUN_EXT]               = PEB_T_OPAQUE,
+    [ERL_EXPORT_EXT]            = PEB_T_OPAQUE,
+    [ERL_BIT_BINARY_EXT]        = PEB_T_OPAQUE,
+};
+
+/*
+ * Integers that do not fit a PHP integer are returned as exact decimal
+ * strings
+ */
+static int _peb_decode_big(ei_x_buff* x, zval* rv)
+{
+    const unsigned char*    p = (const unsigned char*) x->buff + x->index;
+    size_t                  avail = x->buffsz - x->index;
+    size_t                  n, i, hdr;
+    zend_ulong              u = 0;
+    unsigned char*          mag;
+    char*                   out;
+    char*                   end;
+    char*                   d;
+    uint32_t                cur, rem;
+    int                     sign, j;
+
+    if ( p[0] == ERL_SMALL_BIG_EXT ) {
+        hdr = 3;
+        if ( avail < hdr ) {
+            return FAILURE;
+        }
+        n = p[1];
+    }
+    else {
+        hdr = 6;
+        if ( avail < hdr ) {
+            return FAILURE;
+        }
+        n = _peb_get32be(p + 1);
+    }
+
+    if ( n > avail - hdr ) {
+        return FAILURE;
+    }
+    sign = p[hdr-1];
+    p += hdr;
+    x->index += hdr + n;
+
+    /* Digits are little-endian base 256 */
+    while ( n > 0 && p[n-1] == 0 ) {
+        n--;
+    }
+
+    if ( n <= sizeof(zend_ulong) ) {
+        for ( i = n; i-- > 0; ) {
+            u = (u << 8) | p[i];
+        }
+        if ( !sign && u <= ZEND_LONG_MAX ) {
+            ZVAL_LONG(rv, (zend_long) u);
+            return SUCCESS;
+        }
+        if ( sign && u <= (zend_ulong) ZEND_LONG_MAX + 1 ) {
+            ZVAL_LONG(rv, u == (zend_ulong) ZEND_LONG_MAX + 1 ? ZEND_LONG_MIN : -(zend_long) u);
+            return SUCCESS;
+        }
+    }
+
+    /* Four decimal digits per division, every base 256 digit makes < 3 */
+    mag = emalloc(n);
+    memcpy(mag, p, n);
+    out = safe_emalloc(n, 3, 6);
+    end = out + n * 3 + 6;
+    d = end;
+
+    while ( n > 0 ) {
+        for ( rem = 0, i = n; i-- > 0; ) {
+            cur = (rem << 8) | mag[i];
+            mag[i] = (unsigned char) (cur / 10000);
+            rem = cur % 10000;
+        }
+        while ( n > 0 && mag[n-1] == 0 ) {
+            n--;
+        }
+        for ( j = 0; j < 4; j++ ) {
+            *--d = (char) ('0' + rem % 10);
+            rem /= 10;
+        }
+    }
+
+    while ( *d == '0' ) {
+        d++;
+    }
+    if ( sign ) {
+        *--d = '-';
+    }
+
+    ZVAL_STRINGL(rv, d, end - d);
+    efree(mag);
+    efree(out);
+
+    return SUCCESS;
+}
+
+/*
+ * Refs, ports, funs and bit binaries have no PHP counterpart, they are
+ * returned as term resources holding their encoding, which can be printed
+ * with peb_print_term() and sent back with peb_encode_value()
+ */
+static int _peb_decode_opaque(ei_x_buff* x, zval* rv)
+{
+    ei_x_buff*  term;
+    int         index = x->index;
+    int         len;
+    char*       s;
+
+    if ( ei_skip_term(x->buff, &index) < 0 ) {
+        return FAILURE;
+    }
+    len = index - x->index;
+
+    term = emalloc(sizeof(ei_x_buff));
+    ei_x_new(term);
+    if ( (s=_peb_x_reserve(term, len)) == NULL ) {
+        ei_x_free(term);
+        efree(term);
+        return FAILURE;
+    }
+    memcpy(s, x->buff + x->index, len);
+    term->index = len;
+    x->index = index;
+
+    ZVAL_RES(rv, zend_register_resource(term, le_msgbuff));
+
+    return SUCCESS;
+}
+
+/*
+ * Decodes the term at x->index into rv, dispatching on the class of its
+ * tag. Integers, floats, atoms, strings and binaries are read straight from
+ * the buffer. Tuples, lists and maps are filled iteratively, every
+ * unfinished one keeps a frame on the codec stack until its last element
+ * has been decoded. Maps become associative arrays, and so do proplists
+ * with PEB_OPT_PROPLISTS. With PEB_OPT_CHARLISTS strings and lists of code
+ * points become UTF-8 strings. An unknown or truncated term fails the whole
+ * decode with PEB_ERRORNO_DECODE.
+ */
+static int _peb_decode(ei_x_buff* x, zval* rv, int flags) {
+    peb_dec_frame*  stack = _peb_stack_reserve(0);
+    peb_dec_frame*  frame;
+    uint32_t        sp = 0;
+    zval            z;
+    zend_string*    str;
+    unsigned char   tag;
+    const char*     p;
+    int             size;
+    int             hdr;
+    int             proplist;
+    int             plain = 0;
+    char*           buff;
+    double          double_value;
+    uint64_t        bits;
+
+    while ( 1 ) {
+        if ( sp > 0 && stack[sp-1].is_map && !stack[sp-1].has_key ) {
+            frame = &stack[sp-1];
+            if ( frame->is_proplist ) {
+                /*
+                 * Proplists are found while decoding, not by walking the list
+                 * first. An element that is not a {Key, Value} pair with an
+                 * array key throws the hash away and the list is decoded again
+                 * from its header as a plain list.
+                 */
+                if ( ei_decode_tuple_header(x->buff, &x->index, &size) < 0 || size != 2 ||
+                        _peb_decode_key(x, frame) != SUCCESS ) {
+                    x->index = frame->start;
+                    zval_ptr_dtor(&frame->arr);
+                    --sp;
+                    plain = 1;
+                    continue;
+                }
+            }
+            else if ( _peb_decode_key(x, frame) != SUCCESS ) {
+                goto failure;
+            }
+        }
+
+        /* Every tag is followed by at least one byte, or is the last one */
+        if ( x->index >= x->buffsz ) {
+            goto failure;
+        }
+        p = x->buff + x->index;
+        tag = (unsigned char) *p;
+
+        switch ( peb_term_class[tag] )  {
+            case PEB_T_SMALL_INT:
+                if ( x->buffsz - x->index < 2 ) {
+                    goto failure;
+                }
+                ZVAL_LONG(&z, (unsigned char) p[1]);
+                x->index += 2;
+                break;
+
+            case PEB_T_INT:
+                if ( x->buffsz - x->index < 5 ) {
+                    goto failure;
+                }
+                ZVAL_LONG(&z, (int32_t) _peb_get32be((const unsigned char*) p + 1));
+                x->index += 5;
+                break;
+
+            case PEB_T_NEW_FLOAT:
+                if ( x->buffsz - x->index < 9 ) {
+                    goto failure;
+                }
+                bits = ((uint64_t) _peb_get32be((const unsigned char*) p + 1) << 32) |
+                        _peb_get32be((const unsigned char*) p + 5);
+                memcpy(&double_value, &bits, sizeof(double));
+                ZVAL_DOUBLE(&z, double_value);
+                x->index += 9;
+                break;
+
+            case PEB_T_FLOAT:
+                if ( ei_decode_double(x->buff, &x->index, &double_value) < 0 ) {
+                    goto failure;
+                }
+                ZVAL_DOUBLE(&z, double_value);
+                break;
+
+            case PEB_T_ATOM:
+                if ( tag == ERL_SMALL_ATOM_EXT || tag == ERL_SMALL_ATOM_UTF8_EXT ) {
+                    if ( x->buffsz - x->index < 2 ) {
+                        goto failure;
+                    }
+                    size = (unsigned char) p[1];
+                }
+                else {
+                    if ( x->buffsz - x->index < 3 ) {
+                        goto failure;
+                    }
+                    size = ((unsigned char) p[1] << 8) | (unsigned char) p[2];
+                }
+                if ( (str=_peb_decode_atom(x, size)) == NULL ) {
+                    goto failure;
+                }
+                ZVAL_STR(&z, str);
+                break;
+
+            case PEB_T_STRING:
+            case PEB_T_BINARY:
+                /* Copied once, straight from the buffer into the zend_string */
+                hdr = tag == ERL_STRING_EXT ? 3 : 5;
+                if ( x->buffsz - x->index < hdr ) {
+                    goto failure;
+                }
+                if ( tag == ERL_STRING_EXT ) {
+                    size = ((unsigned char) p[1] << 8) | (unsigned char) p[2];
+                }
+                else if ( (size=(int) _peb_get32be((const unsigned char*) p + 1)) < 0 ) {
+                    goto failure;
+                }
+                if ( size > x->buffsz - x->index - hdr ) {
+                    goto failure;
+                }
+                if ( tag == ERL_STRING_EXT && (flags & PEB_OPT_CHARLISTS) ) {
+                    ZVAL_STR(&z, _peb_latin1_to_utf8((const unsigned char*) x->buff + x->index + hdr, size));
+                }
+                else {
+                    ZVAL_STRINGL(&z, x->buff + x->index + hdr, size);
+                }
+                x->index += hdr + size;
+                break;
+
+            case PEB_T_PID:
+                buff = emalloc(sizeof(erlang_pid));
+                if ( ei_decode_pid(x->buff, &x->index, (erlang_pid*)buff) < 0 ) {
+                    efree(buff);
+                    goto failure;
+                }
+                ZVAL_RES(&z, zend_register_resource(buff, le_serverpid));
+                break;
+
+            case PEB_T_BIG:
+                if ( _peb_decode_big(x, &z) != SUCCESS ) {
+                    goto failure;
+                }
+                break;
+
+            case PEB_T_OPAQUE:
+                if ( _peb_decode_opaque(x, &z) != SUCCESS ) {
+                    goto failure;
+                }
+                break;
+
+            case PEB_T_TUPLE:
+            case PEB_T_NIL:
+            case PEB_T_LIST:
+                if ( tag == ERL_LIST_EXT && (flags & PEB_OPT_CHARLISTS) && _peb_decode_charlist(x, &z) == SUCCESS ) {
+                    break;
+                }
+
+                proplist = tag == ERL_LIST_EXT && (flags & PEB_OPT_PROPLISTS) && !plain;
+                plain = 0;
+                hdr = x->index;
+
+                if ( tag == ERL_SMALL_TUPLE_EXT || tag == ERL_LARGE_TUPLE_EXT ) {
+                    if ( ei_decode_tuple_header(x->buff, &x->index, &size) < 0 ) {
+                        goto failure;
+                    }
+                }
+                else if ( ei_decode_list_header(x->buff, &x->index, &size) < 0 ) {
+                    goto failure;
+                }
+
+                if ( size == 0 ) {
+                    array_init(&z);
+                    break;
+                }
+
+                /* Every element takes at least one byte */
+                if ( size > x->buffsz - x->index ) {
+                    goto failure;
+                }
+
+                if ( sp >= PEB_G(max_depth) ) {
+                    PEB_G(errorno) = PEB_ERRORNO_DEPTH;
+                    PEB_G(error) = estrdup(PEB_ERROR_DEPTH);
+                    goto failure;
+                }
+
+                stack = _peb_stack_reserve((sp + 1) * sizeof(peb_dec_frame));
+                frame = &stack[sp++];
+                if ( proplist ) {
+                    array_init_size(&frame->arr, size);
+                }
+                else {
+                    _peb_array_init_packed(&frame->arr, size);
+                }
+                frame->remaining = size;
+                frame->is_list = tag == ERL_LIST_EXT;
+                frame->is_map = proplist;
+                frame->is_proplist = proplist;
+                frame->start = hdr;
+                frame->has_key = 0;
+                frame->key = NULL;
+                continue;
+
+            case PEB_T_MAP:
+                if ( ei_decode_map_header(x->buff, &x->index, &size) < 0 ) {
+                    goto failure;
+                }
+
+                if ( size == 0 ) {
+                    array_init(&z);
+                    break;
+                }
+
+                /* Every key and value takes at least one byte */
+                if ( size > (x->buffsz - x->index) / 2 ) {
+                    goto failure;
+                }
+
+                if ( sp >= PEB_G(max_depth) ) {
+                    PEB_G(errorno) = PEB_ERRORNO_DEPTH;
+                    PEB_G(error) = estrdup(PEB_ERROR_DEPTH);
+                    goto failure;
+                }
+
+                stack = _peb_stack_reserve((sp + 1) * sizeof(peb_dec_frame));
+                frame = &stack[sp++];
+                array_init_size(&frame->arr, size);
+                frame->remaining = size;
+                frame->is_list = 0;
+                frame->is_map = 1;
+                frame->is_proplist = 0;
+                frame->has_key = 0;
+                frame->key = NULL;
+                continue;
+
+            default:
+                /* Unknown tag, the caller gets false and peb_error() */
+                goto failure;
+        }
+
+        if ( sp == 0 ) {
+            ZVAL_COPY_VALUE(rv, &z);
+            return SUCCESS;
+        }
+        _peb_decode_add(&stack[sp-1], &z);
+
+        /* Close every tuple, list and map that has just got its last element */
+        while ( sp > 0 && --stack[sp-1].remaining == 0 ) {
+            frame = &stack[sp-1];
+
+            if ( frame->is_list ) {
+                if ( x->index < x->buffsz &&
+                        peb_term_class[(unsigned char) x->buff[x->index]] != PEB_T_LIST &&
+                        peb_term_class[(unsigned char) x->buff[x->index]] != PEB_T_NIL ) {
+                    /* Improper list, no array could tell [1,2|3] from [1,2,3] */
+                    goto failure;
+                }
+
+                /* The tail is either [] or a continuation of the list */
+                if ( ei_decode_list_header(x->buff, &x->index, &size) < 0 ) {
+                    goto failure;
+                }
+                if ( size > 0 ) {
+                    if ( size > x->buffsz - x->index ) {
+                        goto failure;
+                    }
+                    /* A proplist is filled like a map, its hash is not packed */
+                    zend_hash_extend(Z_ARRVAL(frame->arr),
+                            zend_hash_num_elements(Z_ARRVAL(frame->arr)) + size, !frame->is_proplist);
+                    frame->remaining = size;
+                    break;
+                }
+            }
+
+            if ( --sp == 0 ) {
+                ZVAL_COPY_VALUE(rv, &frame->arr);
+                return SUCCESS;
+            }
+            _peb_decode_add(&stack[sp-1], &frame->arr);
+        }
+    }
+
+failure:
+    while ( sp > 0 ) {
+        frame = &stack[--sp];
+        if ( frame->key != NULL ) {
+            zend_string_release(frame->key);
+        }
+        zval_ptr_dtor(&frame->arr);
+    }
+
+    if ( PEB_G(errorno) == 0 ) {
+        PEB_G(errorno) = PEB_ERRORNO_DECODE;
+        PEB_G(error) = estrdup(PEB_ERROR_DECODE);
+    }
+
+    return FAILURE;
+}
+
+static void php_peb_decode_impl(INTERNAL_FUNCTION_PARAMETERS, int with_version)
+{
+    zval*       tmp;
+    zend_long   flags = 0;
+    ei_x_buff*  x;
+    int         v, result;
+    zval        z;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "r|l", &tmp, &flags) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    if ( (x=(ei_x_buff*)zend_fetch_resource(Z_RES_P(tmp), PEB_TERMRESOURCE, le_msgbuff)) == NULL ) {
+        RETURN_FALSE;
+    }
+
+    x->index = 0;
+    if ( with_version ) {
+        ei_decode_version(x->buff, &x->index, &v);
+    }
+
+    result = _peb_decode(x, &z, (int) flags);
+    if ( result == SUCCESS ) {
+        array_init_size(return_value, 1);
+        add_next_index_zval(return_value, &z);
+    }
+    else {
+        RETURN_FALSE;
+    }
+}
+
+/*
+ * Decodes and Erlang term that was send without version magic number
+ *
+ * Prototype:
+ *      mixed peb_decode(resource msgbuffer [, int options])
+ *
+ * Parameters:
+ *      msgbuffer       message
+ *      options         PEB_PROPLISTS to decode lists of {Key, Value}
+ *                      tuples into assoc arrays, PEB_CHARLISTS to decode
+ *                      strings and lists of code points into UTF-8 strings
+ *
+ * Return:
+ *     array            decodes assoc array
+ *     false            decode failure
+ */
+PHP_FUNCTION(peb_decode)
+{
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    php_peb_decode_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
+}
+
+/*
+ * Decodes and Erlang term that was send with version magic number
+ *
+ * Prototype:
+ *      mixed peb_vdecode(resource msgbuffer [, int options])
+ *
+ * Parameters:
+ *      msgbuffer       message
+ *      options         PEB_PROPLISTS to decode lists of {Key, Value}
+ *                      tuples into assoc arrays, PEB_CHARLISTS to decode
+ *                      strings and lists of code points into UTF-8 strings
+ *
+ * Return:
+ *     array            decodes assoc array
+ *     false            decode failure
+ */
+PHP_FUNCTION(peb_vdecode)
+{
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    php_peb_decode_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
+}
+
+/*
+ * PebTerm, a lazily decoded tuple or list
+ *
+ * The object keeps the term resource alive and remembers where its tuple
+ * or list starts in the buffer. Element offsets are indexed on demand with
+ * ei_skip_term(), so untouched elements are only skipped over, and an
+ * element is decoded when it is accessed. Nested non-empty tuples and lists
+ * are returned as PebTerm objects over the same buffer.
+ */
+static inline peb_term_object* peb_term_from_obj(zend_object* obj)
+{
+    return (peb_term_object*)((char*)(obj) - XtOffsetOf(peb_term_object, std));
+}
+
+#define Z_PEB_TERM_P(zv)        peb_term_from_obj(Z_OBJ_P(zv))
+
+static zend_object* peb_term_create(zend_class_entry* ce)
+{
+    peb_term_object*    obj;
+
+    obj = ecalloc(1, sizeof(peb_term_object) + zend_object_properties_size(ce));
+    ZVAL_UNDEF(&obj->msg);
+
+    zend_object_std_init(&obj->std, ce);
+    object_properties_init(&obj->std, ce);
+    obj->std.handlers = &peb_term_handlers;
+
+    return &obj->std;
+}
+
+static void peb_term_free(zend_object* object)
+{
+    peb_term_object*    obj = peb_term_from_obj(object);
+
+    zval_ptr_dtor(&obj->msg);
+    if ( obj->index != NULL ) {
+        efree(obj->index);
+    }
+
+    zend_object_std_dtor(&obj->std);
+}
+
+/*
+ * Wraps the non-empty tuple or list found at offset of the term resource
+ */
+static void _peb_term_init(zval* rv, zval* msg, int offset)
+{
+    ei_x_buff*          x = (ei_x_buff*) Z_RES_VAL_P(msg);
+    peb_term_object*    obj;
+    int                 index = offset;
+    int                 type, size;
+
+    object_init_ex(rv, peb_term_ce);
+    obj = Z_PEB_TERM_P(rv);
+    ZVAL_COPY(&obj->msg, msg);
+    obj->offset = offset;
+
+    ei_get_type(x->buff, &index, &type, &size);
+    obj->is_list = type == ERL_LIST_EXT;
+    if ( obj->is_list ) {
+        ei_decode_list_header(x->buff, &index, &size);
+    }
+    else {
+        ei_decode_tuple_header(x->buff, &index, &size);
+    }
+
+    obj->arity = size;
+    obj->remaining = size;
+    obj->next = index;
+}
+
+/*
+ * Indexes element offsets until element n is known or the term ends
+ */
+static void _peb_term_index(peb_term_object* obj, uint32_t n)
+{
+    ei_x_buff*      x = (ei_x_buff*) Z_RES_VAL(obj->msg);
+    int             size;
+
+    while ( obj->count <= n && !obj->complete ) {
+        if ( obj->remaining == 0 ) {
+            /* A list tail is either [] or a continuation of the list */
+            if ( !obj->is_list || ei_decode_list_header(x->buff, &obj->next, &size) < 0 || size == 0 ) {
+                obj->complete = 1;
+                break;
+            }
+            obj->remaining = size;
+        }
+
+        if ( obj->count == obj->size ) {
+            obj->size = obj->size ? obj->size * 2 : 16;
+            obj->index = safe_erealloc(obj->index, obj->size, sizeof(int), 0);
+        }
+
+        obj->index[obj->count] = obj->next;
+        if ( ei_skip_term(x->buff, &obj->next) < 0 ) {
+            obj->complete = 1;
+            break;
+        }
+        obj->count++;
+        obj->remaining--;
+    }
+}
+
+/*
+ * Decodes the term at offset of the term resource, non-empty tuples and
+ * lists are returned as PebTerm objects
+ */
+static int _peb_term_value(zval* msg, int offset, zval* rv)
+{
+    ei_x_buff*      x = (ei_x_buff*) Z_RES_VAL_P(msg);
+    ei_x_buff       view;
+    int             index = offset;
+    int             type, size;
+
+    if ( ei_get_type(x->buff, &index, &type, &size) < 0 ) {
+        PEB_G(errorno) = PEB_ERRORNO_DECODE;
+        PEB_G(error) = estrdup(PEB_ERROR_DECODE);
+        return FAILURE;
+    }
+
+    if ( size > 0 && (type == ERL_SMALL_TUPLE_EXT || type == ERL_LARGE_TUPLE_EXT || type == ERL_LIST_EXT) ) {
+        _peb_term_init(rv, msg, offset);
+        return SUCCESS;
+    }
+
+    view = *x;
+    view.index = offset;
+
+    return _peb_decode(&view, rv, 0);
+}
+
+static int _peb_term_element(peb_term_object* obj, zend_long n, zval* rv)
+{
+    if ( n < 0 || n >= UINT32_MAX ) {
+        return FAILURE;
+    }
+
+    _peb_term_index(obj, (uint32_t) n);
+    if ( (uint32_t) n >= obj->count ) {
+        return FAILURE;
+    }
+
+    return _peb_term_value(&obj->msg, obj->index[n], rv);
+}
+
+static uint32_t _peb_term_count(peb_term_object* obj)
+{
+    if ( !obj->is_list ) {
+        return obj->arity;
+    }
+
+    _peb_term_index(obj, UINT32_MAX);
+
+    return obj->count;
+}
+
+/*
+ * Iterator over the elements of a PebTerm, used by foreach
+ */
+static void peb_term_it_dtor(zend_object_iterator* iter)
+{
+    peb_term_iterator*  it = (peb_term_iterator*) iter;
+
+    zval_ptr_dtor(&it->current);
+    zval_ptr_dtor(&iter->data);
+}
+
+static int peb_term_it_valid(zend_object_iterator* iter)
+{
+    peb_term_iterator*  it = (peb_term_iterator*) iter;
+    peb_term_object*    obj = Z_PEB_TERM_P(&iter->data);
+
+    _peb_term_index(obj, it->pos);
+
+    return it->pos < obj->count ? SUCCESS : FAILURE;
+}
+
+static zval* peb_term_it_current(zend_object_iterator* iter)
+{
+    peb_term_iterator*  it = (peb_term_iterator*) iter;
+
+    if ( Z_ISUNDEF(it->current) &&
+            _peb_term_element(Z_PEB_TERM_P(&iter->data), it->pos, &it->current) != SUCCESS ) {
+        ZVAL_NULL(&it->current);
+    }
+
+    return &it->current;
+}
+
+static void peb_term_it_key(zend_object_iterator* iter, zval* key)
+{
+    ZVAL_LONG(key, ((peb_term_iterator*) iter)->pos);
+}
+
+static void peb_term_it_next(zend_object_iterator* iter)
+{
+    peb_term_iterator*  it = (peb_term_iterator*) iter;
+
+    zval_ptr_dtor(&it->current);
+    ZVAL_UNDEF(&it->current);
+    it->pos++;
+}
+
+static void peb_term_it_rewind(zend_object_iterator* iter)
+{
+    peb_term_iterator*  it = (peb_term_iterator*) iter;
+
+    zval_ptr_dtor(&it->current);
+    ZVAL_UNDEF(&it->current);
+    it->pos = 0;
+}
+
+static const zend_object_iterator_funcs peb_term_it_funcs = {
+    peb_term_it_dtor,
+    peb_term_it_valid,
+    peb_term_it_current,
+    peb_term_it_key,
+    peb_term_it_next,
+    peb_term_it_rewind,
+    NULL,
+#if PHP_VERSION_ID >= 80000
+    NULL,
+#endif
+};
+
+static zend_object_iterator* peb_term_get_iterator(zend_class_entry* ce, zval* object, int by_ref)
+{
+    peb_term_iterator*  it;
+
+    if ( by_ref ) {
+        zend_throw_error(NULL, "An iterator cannot be used with foreach by reference");
+        return NULL;
+    }
+
+    it = emalloc(sizeof(peb_term_iterator));
+    zend_iterator_init(&it->intern);
+    ZVAL_COPY(&it->intern.data, object);
+    it->intern.funcs = &peb_term_it_funcs;
+    it->pos = 0;
+    ZVAL_UNDEF(&it->current);
+
+    return &it->intern;
+}
+
+/*
+ * Terms only come from peb_decode_lazy(), an object without its message
+ * would have nothing to read
+ */
+PHP_METHOD(PebTerm, __construct)
+{
+    zend_throw_error(NULL, "PebTerm cannot be constructed, use peb_decode_lazy()");
+}
+
+/*
+ * Offsets are integers or integer strings like array keys, anything else
+ * names no element
+ */
+static int _peb_term_offset(zval* offset, zend_long* n)
+{
+    ZVAL_DEREF(offset);
+
+    if ( Z_TYPE_P(offset) == IS_LONG ) {
+        *n = Z_LVAL_P(offset);
+        return SUCCESS;
+    }
+    if ( Z_TYPE_P(offset) == IS_STRING &&
+            is_numeric_string(Z_STRVAL_P(offset), Z_STRLEN_P(offset), n, NULL, 0) == IS_LONG ) {
+        return SUCCESS;
+    }
+
+    return FAILURE;
+}
+
+/*
+ * Returns the element at the given offset, null when there is none
+ *
+ * Prototype:
+ *      mixed PebTerm::offsetGet(int offset)
+ */
+PHP_METHOD(PebTerm, offsetGet)
+{
+    zval*       offset;
+    zend_long   n;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "z", &offset) == FAILURE ) {
+        RETURN_NULL();
+    }
+
+    if ( _peb_term_offset(offset, &n) != SUCCESS ||
+            _peb_term_element(Z_PEB_TERM_P(getThis()), n, return_value) != SUCCESS ) {
+        RETURN_NULL();
+    }
+}
+
+/*
+ * Checks whether the tuple or list has an element at the given offset
+ *
+ * Prototype:
+ *      bool PebTerm::offsetExists(int offset)
+ */
+PHP_METHOD(PebTerm, offsetExists)
+{
+    zval*               offset;
+    zend_long           n;
+    peb_term_object*    obj = Z_PEB_TERM_P(getThis());
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "z", &offset) == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    if ( _peb_term_offset(offset, &n) != SUCCESS || n < 0 || n >= UINT32_MAX ) {
+        RETURN_FALSE;
+    }
+
+    _peb_term_index(obj, (uint32_t) n);
+    RETURN_BOOL((uint32_t) n < obj->count);
+}
+
+/*
+ * PebTerm is read-only
+ *
+ * Prototype:
+ *      void PebTerm::offsetSet(mixed offset, mixed value)
+ */
+PHP_METHOD(PebTerm, offsetSet)
+{
+    zend_throw_error(NULL, "PebTerm is read-only");
+}
+
+/*
+ * PebTerm is read-only
+ *
+ * Prototype:
+ *      void PebTerm::offsetUnset(mixed offset)
+ */
+PHP_METHOD(PebTerm, offsetUnset)
+{
+    zend_throw_error(NULL, "PebTerm is read-only");
+}
+
+/*
+ * Returns the tuple arity or the list length
+ *
+ * Prototype:
+ *      int PebTerm::count()
+ */
+PHP_METHOD(PebTerm, count)
+{
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    RETURN_LONG(_peb_term_count(Z_PEB_TERM_P(getThis())));
+}
+
+/*
+ * Returns an iterator over the elements
+ *
+ * Prototype:
+ *      Iterator PebTerm::getIterator()
+ */
+PHP_METHOD(PebTerm, getIterator)
+{
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+#if PHP_VERSION_ID >= 80000
+    zend_create_internal_iterator_zval(return_value, getThis());
+#else
+    zend_throw_error(NULL, "PebTerm::getIterator() requires PHP 8, iterate the object with foreach");
+#endif
+}
+
+/*
+ * Decodes the whole tuple or list like peb_decode() does for a term
+ *
+ * Prototype:
+ *      array PebTerm::toArray()
+ */
+PHP_METHOD(PebTerm, toArray)
+{
+    peb_term_object*    obj = Z_PEB_TERM_P(getThis());
+    ei_x_buff           view;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    view = *(ei_x_buff*) Z_RES_VAL(obj->msg);
+    view.index = obj->offset;
+
+    if ( _peb_decode(&view, return_value, 0) != SUCCESS ) {
+        RETURN_FALSE;
+    }
+}
+
+static void php_peb_decode_lazy_impl(INTERNAL_FUNCTION_PARAMETERS, int with_version)
+{
+    zval*       tmp;
+    ei_x_buff*  x;
+    int         index = 0;
+    int         v;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "r", &tmp) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    if ( (x=(ei_x_buff*)zend_fetch_resource(Z_RES_P(tmp), PEB_TERMRESOURCE, le_msgbuff)) == NULL ) {
+        RETURN_FALSE;
+    }
+
+    if ( with_version && ei_decode_version(x->buff, &index, &v) < 0 ) {
+        PEB_G(errorno) = PEB_ERRORNO_DECODE;
+        PEB_G(error) = estrdup(PEB_ERROR_DECODE);
+        RETURN_FALSE;
+    }
+
+    if ( _peb_term_value(tmp, index, return_value) != SUCCESS ) {
+        RETURN_FALSE;
+    }
+}
+
+/*
+ * Lazily decodes an Erlang term that was send without version magic number
+ *
+ * Prototype:
+ *      mixed peb_decode_lazy(resource msgbuffer)
+ *
+ * Parameters:
+ *      msgbuffer       message
+ *
+ * Return:
+ *     PebTerm          for a non-empty tuple or list, decoded on access
+ *     mixed            any other term, decoded
+ *     false            decode failure
+ */
+PHP_FUNCTION(peb_decode_lazy)
+{
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    php_peb_decode_lazy_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
+}
+
+/*
+ * Lazily decodes an Erlang term that was send with version magic number
+ *
+ * Prototype:
+ *      mixed peb_vdecode_lazy(resource msgbuffer)
+ *
+ * Parameters:
+ *      msgbuffer       message
+ *
+ * Return:
+ *     PebTerm          for a non-empty tuple or list, decoded on access
+ *     mixed            any other term, decoded
+ *     false            decode failure
+ */
+PHP_FUNCTION(peb_vdecode_lazy)
+{
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    php_peb_decode_lazy_impl(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
+}
+
+/*
+ * Moves *index from a tuple or list to its element n, the elements before
+ * it are skipped without being decoded
+ */
+static int _peb_term_seek(const char* buff, int* index, zend_ulong n)
+{
+    int         type, size;
+
+    if ( ei_get_type(buff, index, &type, &size) < 0 ) {
+        return FAILURE;
+    }
+
+    if ( type == ERL_SMALL_TUPLE_EXT || type == ERL_LARGE_TUPLE_EXT ) {
+        if ( ei_decode_tuple_header(buff, index, &size) < 0 || n >= (zend_ulong) size ) {
+            return FAILURE;
+        }
+    }
+    else if ( type == ERL_LIST_EXT ) {
+        if ( ei_decode_list_header(buff, index, &size) < 0 ) {
+            return FAILURE;
+        }
+
+        /* Whole chunks are skipped until the one holding element n */
+        while ( n >= (zend_ulong) size ) {
+            for ( ; size > 0; size--, n-- ) {
+                if ( ei_skip_term(buff, index) < 0 ) {
+                    return FAILURE;
+                }
+            }
+            if ( ei_decode_list_header(buff, index, &size) < 0 || size == 0 ) {
+                return FAILURE;
+            }
+        }
+    }
+    else {
+        return FAILURE;
+    }
+
+    for ( ; n > 0; n-- ) {
+        if ( ei_skip_term(buff, index) < 0 ) {
+            return FAILURE;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Follows a path of zero-based element numbers separated by dots, such as
+ * "1.2", from the term at *index. An empty path addresses the term itself.
+ */
+static int _peb_term_path(const char* buff, int* index, const char* path, size_t len)
+{
+    const char*     p = path;
+    const char*     end = path + len;
+    zend_ulong      n;
+
+    while ( p < end ) {
+        if ( *p < '0' || *p > '9' ) {
+            return FAILURE;
+        }
+
+        for ( n = 0; p < end && *p >= '0' && *p <= '9'; p++ ) {
+            if ( n > (UINT32_MAX - 9) / 10 ) {
+                return FAILURE;
+            }
+            n = n * 10 + (*p - '0');
+        }
+
+        if ( p < end && *p++ != '.' ) {
+            return FAILURE;
+        }
+
+        if ( _peb_term_seek(buff, index, n) != SUCCESS ) {
+            return FAILURE;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Accepts a term resource or a PebTerm and returns its buffer, *index is
+ * set to the start of the term (past the version magic, if any)
+ */
+static ei_x_buff* _peb_term_arg(zval* term, int* index)
+{
+    ei_x_buff*          x;
+    peb_term_object*    obj;
+
+    if ( Z_TYPE_P(term) == IS_OBJECT && Z_OBJCE_P(term) == peb_term_ce ) {
+        obj = Z_PEB_TERM_P(term);
+        if ( Z_ISUNDEF(obj->msg) ) {
+            return NULL;
+        }
+        *index = obj->offset;
+        return (ei_x_buff*) Z_RES_VAL(obj->msg);
+    }
+
+    if ( Z_TYPE_P(term) != IS_RESOURCE ||
+            (x=(ei_x_buff*)zend_fetch_resource(Z_RES_P(term), PEB_TERMRESOURCE, le_msgbuff)) == NULL ) {
+        return NULL;
+    }
+
+    *index = 0;
+    if ( x->index > 0 && (unsigned char) x->buff[0] == ERL_VERSION_MAGIC ) {
+        *index = 1;
+    }
+
+    return x;
+}
+
+/*
+ * Decodes the subterm at path into rv, null when the path does not exist
+ */
+static int _peb_term_get(ei_x_buff* x, int index, zval* path, zval* rv)
+{
+    ei_x_buff       view;
+    zend_string*    str;
+    int             result;
+
+    str = zval_get_string(path);
+    result = _peb_term_path(x->buff, &index, ZSTR_VAL(str), ZSTR_LEN(str));
+    zend_string_release(str);
+
+    if ( result != SUCCESS ) {
+        ZVAL_NULL(rv);
+        return SUCCESS;
+    }
+
+    view = *x;
+    view.index = index;
+
+    return _peb_decode(&view, rv, 0);
+}
+
+/*
+ * Decodes a single subterm without decoding the rest of the term
+ *
+ * Prototype:
+ *      mixed peb_term_get(mixed term, string path)
+ *
+ * Parameters:
+ *      term            message resource or PebTerm
+ *      path            zero-based element numbers separated by dots,
+ *                      e.g. "1.2" is Cursor in {ok, {Meta, Rows, Cursor}}
+ *
+ * Return:
+ *     mixed            decoded subterm
+ *     null             no such element
+ *     false            decode failure
+ */
+PHP_FUNCTION(peb_term_get)
+{
+    zval*       term;
+    zval*       path;
+    ei_x_buff*  x;
+    int         index;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "zz", &term, &path) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    if ( (x=_peb_term_arg(term, &index)) == NULL ) {
+        RETURN_FALSE;
+    }
+
+    if ( _peb_term_get(x, index, path, return_value) != SUCCESS ) {
+        RETURN_FALSE;
+    }
+}
+
+/*
+ * Decodes several subterms without decoding the rest of the term
+ *
+ * Prototype:
+ *      array peb_term_get_many(mixed term, array paths)
+ *
+ * Parameters:
+ *      term            message resource or PebTerm
+ *      paths           paths as accepted by peb_term_get()
+ *
+ * Return:
+ *     array            decoded subterms under the keys of paths, null
+ *                      for the paths that do not exist
+ *     false            decode failure
+ */
+PHP_FUNCTION(peb_term_get_many)
+{
+    zval*           term;
+    zval*           paths;
+    zval*           path;
+    zval            z;
+    zend_string*    key;
+    zend_ulong      idx;
+    ei_x_buff*      x;
+    int             index;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "za", &term, &paths) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    if ( (x=_peb_term_arg(term, &index)) == NULL ) {
+        RETURN_FALSE;
+    }
+
+    array_init_size(return_value, zend_hash_num_elements(Z_ARRVAL_P(paths)));
+
+    ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(paths), idx, key, path) {
+        if ( _peb_term_get(x, index, path, &z) != SUCCESS ) {
+            zval_ptr_dtor(return_value);
+            RETURN_FALSE;
+        }
+
+        if ( key != NULL ) {
+            zend_hash_update(Z_ARRVAL_P(return_value), key, &z);
+        }
+        else {
+            zend_hash_index_update(Z_ARRVAL_P(return_value), idx, &z);
+        }
+    } ZEND_HASH_FOREACH_END();
+}
+
+/*
+ * Returns the encoding of a term as a string with the version number in
+ * front, like term_to_binary/1. The bytes are copied, not decoded.
+ *
+ * Prototype:
+ *      string peb_term_to_string(mixed term)
+ *
+ * Parameters:
+ *      term            message resource or PebTerm
+ *
+ * Return:
+ *     string           encoded term
+ *     false            failure
+ */
+PHP_FUNCTION(peb_term_to_string)
+{
+    zval*           term;
+    ei_x_buff*      x;
+    zend_string*    str;
+    int             index, end;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "z", &term) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    if ( (x=_peb_term_arg(term, &index)) == NULL ) {
+        RETURN_FALSE;
+    }
+
+    if ( (end=_peb_term_end(x->buff, x->buffsz, index)) < 0 ) {
+        PEB_G(errorno) = PEB_ERRORNO_DECODE;
+        PEB_G(error) = estrdup(PEB_ERROR_DECODE);
+        RETURN_FALSE;
+    }
+
+    str = zend_string_alloc(1 + end - index, 0);
+    ZSTR_VAL(str)[0] = (char) ERL_VERSION_MAGIC;
+    memcpy(ZSTR_VAL(str) + 1, x->buff + index, end - index);
+    ZSTR_VAL(str)[1 + end - index] = '\0';
+
+    RETURN_NEW_STR(str);
+}
+
+/*
+ * Makes a term resource of an encoded term, e.g. one returned by
+ * peb_term_to_string() or peb_receive_raw(). The bytes are checked to hold
+ * exactly one term, with or without the version number, and kept as they
+ * are.
+ *
+ * Prototype:
+ *      resource peb_string_to_term(string bytes)
+ *
+ * Parameters:
+ *      bytes           encoded term
+ *
+ * Return:
+ *     messageid        success, use peb_vdecode() when bytes has the
+ *                      version number and peb_decode() otherwise
+ *     false            not an encoded term
+ */
+PHP_FUNCTION(peb_string_to_term)
+{
+    char*           bytes;
+    size_t          bytes_len;
+    ei_x_buff*      x;
+    char*           s;
+    int             index = 0;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "s", &bytes, &bytes_len) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    if ( bytes_len > 0 && (unsigned char) bytes[0] == ERL_VERSION_MAGIC ) {
+        index = 1;
+    }
+
+    if ( bytes_len > INT_MAX || _peb_term_end(bytes, (int) bytes_len, index) != (int) bytes_len ) {
+        PEB_G(errorno) = PEB_ERRORNO_DECODE;
+        PEB_G(error) = estrdup(PEB_ERROR_DECODE);
+        RETURN_FALSE;
+    }
+
+    x = emalloc(sizeof(ei_x_buff));
+    ei_x_new(x);
+    if ( (s=_peb_x_reserve(x, bytes_len)) == NULL ) {
+        ei_x_free(x);
+        efree(x);
+        RETURN_FALSE;
+    }
+    memcpy(s, bytes, bytes_len);
+    x->index = (int) bytes_len;
+
+    RETVAL_RES(zend_register_resource(x, le_msgbuff));
+}
+
+/*
+ * PebListIterator, a forward only decoder over a list
+ *
+ * Only the current element is decoded and alive, the next step decodes the
+ * following element in place, crossing list chunks as the tail of each one
+ * says. Rewinding starts over from the list header.
+ */
+static inline peb_list_object* peb_list_from_obj(zend_object* obj)
+{
+    return (peb_list_object*)((char*)(obj) - XtOffsetOf(peb_list_object, std));
+}
+
+#define Z_PEB_LIST_P(zv)        peb_list_from_obj(Z_OBJ_P(zv))
+
+static zend_object* peb_list_create(zend_class_entry* ce)
+{
+    peb_list_object*    obj;
+
+    obj = ecalloc(1, sizeof(peb_list_object) + zend_object_properties_size(ce));
+    ZVAL_UNDEF(&obj->msg);
+    ZVAL_UNDEF(&obj->current);
+
+    zend_object_std_init(&obj->std, ce);
+    object_properties_init(&obj->std, ce);
+    obj->std.handlers = &peb_list_handlers;
+
+    return &obj->std;
+}
+
+static void peb_list_free(zend_object* object)
+{
+    peb_list_object*    obj = peb_list_from_obj(object);
+
+    zval_ptr_dtor(&obj->current);
+    zval_ptr_dtor(&obj->msg);
+
+    zend_object_std_dtor(&obj->std);
+}
+
+/*
+ * Decodes the next element into current, current is left UNDEF at the end
+ * of the list. An element or tail that cannot be decoded sets
+ * PEB_ERRORNO_DECODE and throws, the iterator then stays at its end until
+ * rewound.
+ */
+static void _peb_list_fetch(peb_list_object* obj)
+{
+    ei_x_buff*      x;
+    ei_x_buff       view;
+    int             size;
+
+    zval_ptr_dtor(&obj->current);
+    ZVAL_UNDEF(&obj->current);
+
+    if ( Z_ISUNDEF(obj->msg) || obj->failed ) {
+        return;
+    }
+    x = (ei_x_buff*) Z_RES_VAL(obj->msg);
+
+    if ( obj->remaining == 0 ) {
+        /* The tail is either [] or a continuation of the list, improper lists fail */
+        if ( ei_decode_list_header(x->buff, &obj->next, &size) < 0 ) {
+            goto failure;
+        }
+        if ( size == 0 ) {
+            return;
+        }
+        obj->remaining = size;
+    }
+
+    view = *x;
+    view.index = obj->next;
+    if ( _peb_decode(&view, &obj->current, 0) != SUCCESS ) {
+        ZVAL_UNDEF(&obj->current);
+        goto failure;
+    }
+
+    obj->next = view.index;
+    obj->remaining--;
+    obj->pos++;
+    return;
+
+failure:
+    /* A list cut short must not look complete, so foreach does not just end */
+    obj->remaining = 0;
+    obj->failed = 1;
+    if ( PEB_G(errorno) == 0 ) {
+        PEB_G(errorno) = PEB_ERRORNO_DECODE;
+        PEB_G(error) = estrdup(PEB_ERROR_DECODE);
+    }
+    zend_throw_error(NULL, "PebListIterator failed to decode the list, see peb_error()");
+}
+
+static void _peb_list_rewind(peb_list_object* obj)
+{
+    obj->next = obj->offset;
+    obj->remaining = 0;
+    obj->pos = -1;
+    obj->failed = 0;
+
+    _peb_list_fetch(obj);
+}
+
+/*
+ * Iterator used by foreach, it drives the object itself
+ */
+static void peb_list_it_dtor(zend_object_iterator* iter)
+{
+    zval_ptr_dtor(&iter->data);
+}
+
+static int peb_list_it_valid(zend_object_iterator* iter)
+{
+    return Z_ISUNDEF(Z_PEB_LIST_P(&iter->data)->current) ? FAILURE : SUCCESS;
+}
+
+static zval* peb_list_it_current(zend_object_iterator* iter)
+{
+    return &Z_PEB_LIST_P(&iter->data)->current;
+}
+
+static void peb_list_it_key(zend_object_iterator* iter, zval* key)
+{
+    ZVAL_LONG(key, Z_PEB_LIST_P(&iter->data)->pos);
+}
+
+static void peb_list_it_next(zend_object_iterator* iter)
+{
+    _peb_list_fetch(Z_PEB_LIST_P(&iter->data));
+}
+
+static void peb_list_it_rewind(zend_object_iterator* iter)
+{
+    _peb_list_rewind(Z_PEB_LIST_P(&iter->data));
+}
+
+static const zend_object_iterator_funcs peb_list_it_funcs = {
+    peb_list_it_dtor,
+    peb_list_it_valid,
+    peb_list_it_current,
+    peb_list_it_key,
+    peb_list_it_next,
+    peb_list_it_rewind,
+    NULL,
+#if PHP_VERSION_ID >= 80000
+    NULL,
+#endif
+};
+
+static zend_object_iterator* peb_list_get_iterator(zend_class_entry* ce, zval* object, int by_ref)
+{
+    zend_object_iterator*   it;
+
+    if ( by_ref ) {
+        zend_throw_error(NULL, "An iterator cannot be used with foreach by reference");
+        return NULL;
+    }
+
+    it = emalloc(sizeof(zend_object_iterator));
+    zend_iterator_init(it);
+    ZVAL_COPY(&it->data, object);
+    it->funcs = &peb_list_it_funcs;
+
+    return it;
+}
+
+/*
+ * Iterators only come from peb_decode_iter()
+ */
+PHP_METHOD(PebListIterator, __construct)
+{
+    zend_throw_error(NULL, "PebListIterator cannot be constructed, use peb_decode_iter()");
+}
+
+/*
+ * Returns the current element, null past the end
+ *
+ * Prototype:
+ *      mixed PebListIterator::current()
+ */
+PHP_METHOD(PebListIterator, current)
+{
+    peb_list_object*    obj = Z_PEB_LIST_P(getThis());
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    if ( !Z_ISUNDEF(obj->current) ) {
+        ZVAL_COPY(return_value, &obj->current);
+    }
+}
+
+/*
+ * Returns the position of the current element, null past the end
+ *
+ * Prototype:
+ *      int PebListIterator::key()
+ */
+PHP_METHOD(PebListIterator, key)
+{
+    peb_list_object*    obj = Z_PEB_LIST_P(getThis());
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    if ( !Z_ISUNDEF(obj->current) ) {
+        RETURN_LONG(obj->pos);
+    }
+}
+
+/*
+ * Decodes the next element, releasing the current one
+ *
+ * Prototype:
+ *      void PebListIterator::next()
+ */
+PHP_METHOD(PebListIterator, next)
+{
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    _peb_list_fetch(Z_PEB_LIST_P(getThis()));
+}
+
+/*
+ * Starts over from the first element
+ *
+ * Prototype:
+ *      void PebListIterator::rewind()
+ */
+PHP_METHOD(PebListIterator, rewind)
+{
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    _peb_list_rewind(Z_PEB_LIST_P(getThis()));
+}
+
+/*
+ * Prototype:
+ *      bool PebListIterator::valid()
+ */
+PHP_METHOD(PebListIterator, valid)
+{
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE ) {
+        RETURN_FALSE;
+    }
+
+    RETURN_BOOL(!Z_ISUNDEF(Z_PEB_LIST_P(getThis())->current));
+}
+
+/*
+ * Decodes a list one element at a time
+ *
+ * Prototype:
+ *      PebListIterator peb_decode_iter(mixed term)
+ *
+ * Parameters:
+ *      term            message resource or PebTerm holding a list
+ *
+ * Return:
+ *     PebListIterator  decoding one element per step
+ *     false            the term is not a list
+ *
+ * An element or tail that cannot be decoded, an improper list included,
+ * throws an Error from the iteration step that reaches it and sets
+ * PEB_ERRORNO_DECODE, so a list cut short never looks complete.
+ */
+PHP_FUNCTION(peb_decode_iter)
+{
+    zval*               term;
+    ei_x_buff*          x;
+    peb_list_object*    obj;
+    int                 index, type, size;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "z", &term) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    if ( (x=_peb_term_arg(term, &index)) == NULL ) {
+        RETURN_FALSE;
+    }
+
+    if ( ei_get_type(x->buff, &index, &type, &size) < 0 || (type != ERL_LIST_EXT && type != ERL_NIL_EXT) ) {
+        PEB_G(errorno) = PEB_ERRORNO_DECODE;
+        PEB_G(error) = estrdup(PEB_ERROR_DECODE);
+        RETURN_FALSE;
+    }
+
+    object_init_ex(return_value, peb_list_ce);
+    obj = Z_PEB_LIST_P(return_value);
+    if ( Z_TYPE_P(term) == IS_OBJECT ) {
+        ZVAL_COPY(&obj->msg, &Z_PEB_TERM_P(term)->msg);
+    }
+    else {
+        ZVAL_COPY(&obj->msg, term);
+    }
+    obj->offset = index;
+
+    _peb_list_rewind(obj);
+}
+
+/*
+ * Decodes one cell of a row, integers and floats are read in place
+ */
+/*
+ * Decodes a list of tuples of the same arity column by column
+ *
+ * Prototype:
+ *      array peb_decode_columns(mixed term)
+ *
+ * Parameters:
+ *      term            message resource or PebTerm holding a list of tuples
+ *
+ * Return:
+ *     array            one list per tuple element, holding that element of
+ *                      every tuple in order
+ *     false            the term is not a list of tuples of the same arity
+ */
+PHP_FUNCTION(peb_decode_columns)
+{
+    zval*           term;
+    zval*           columns = NULL;
+    zval            z;
+    ei_x_buff*      x;
+    ei_x_buff       view;
+    int             index, size, arity, rows, i;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "z", &term) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    if ( (x=_peb_term_arg(term, &index)) == NULL ) {
+        RETURN_FALSE;
+    }
+
+    view = *x;
+    view.index = index;
+
+    if ( ei_decode_list_header(view.buff, &view.index, &rows) < 0 ) {
+        goto failure;
+    }
+
+    if ( rows == 0 ) {
+        array_init(return_value);
+        return;
+    }
+
+    /*
+     * The first row gives the arity. Every tuple takes at least two bytes and
+     * every cell at least one, so a header claiming more than the buffer
+     * holds fails before anything is allocated for it.
+     */
+    index = view.index;
+    if ( ei_decode_tuple_header(view.buff, &index, &arity) < 0 || rows > (view.buffsz - view.index) / 2 ||
+            (size_t) rows * arity > (size_t) (view.buffsz - view.index) ) {
+        goto failure;
+    }
+
+    array_init_size(return_value, arity);
+    columns = safe_emalloc(arity, sizeof(zval), 0);
+    for ( i = 0; i < arity; i++ ) {
+        _peb_array_init_packed(&columns[i], rows);
+    }
+
+    while ( rows > 0 ) {
+        for ( ; rows > 0; rows-- ) {
+            if ( ei_decode_tuple_header(view.buff, &view.index, &size) < 0 || size != arity ) {
+                goto failure;
+            }
+
+            for ( i = 0; i < arity; i++ ) {
+                if ( _peb_decode(&view, &z, 0) != SUCCESS ) {
+                    goto failure;
+                }
+                _peb_array_append(&columns[i], &z);
+            }
+        }
+
+        /* The tail is either [] or a continuation of the list */
+        if ( ei_decode_list_header(view.buff, &view.index, &rows) < 0 ) {
+            goto failure;
+        }
+        if ( rows > (view.buffsz - view.index) / 2 || (size_t) rows * arity > (size_t) (view.buffsz - view.index) ) {
+            goto failure;
+        }
+        for ( i = 0; rows > 0 && i < arity; i++ ) {
+            zend_hash_extend(Z_ARRVAL(columns[i]), zend_hash_num_elements(Z_ARRVAL(columns[i])) + rows, 1);
+        }
+    }
+
+    for ( i = 0; i < arity; i++ ) {
+        add_next_index_zval(return_value, &columns[i]);
+    }
+    efree(columns);
+    return;
+
+failure:
+    if ( columns != NULL ) {
+        for ( i = 0; i < arity; i++ ) {
+            zval_ptr_dtor(&columns[i]);
+        }
+        efree(columns);
+        zval_ptr_dtor(return_value);
+    }
+
+    if ( PEB_G(errorno) == 0 ) {
+        PEB_G(errorno) = PEB_ERRORNO_DECODE;
+        PEB_G(error) = estrdup(PEB_ERROR_DECODE);
+    }
+    RETURN_FALSE;
+}
+
+/*
+ * Packed vectors, numeric arrays as big-endian binaries
+ */
+static int _peb_vec_type(const char* type, size_t len, int* width)
+{
+    static const struct {
+        const char* name;
+        int         code;
+        int         width;
+    } types[] = {
+        { "float64", PEB_VEC_FLOAT64, 8 },
+        { "float32", PEB_VEC_FLOAT32, 4 },
+        { "int64", PEB_VEC_INT64, 8 },
+        { "int32", PEB_VEC_INT32, 4 },
+        { "int16", PEB_VEC_INT16, 2 },
+    };
+    size_t      i;
+
+    for ( i = 0; i < sizeof(types) / sizeof(types[0]); i++ ) {
+        if ( strlen(types[i].name) == len && memcmp(types[i].name, type, len) == 0 ) {
+            *width = types[i].width;
+            return types[i].code;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Copies n bytes of width byte elements from s to d, swapping the byte
+ * order of every element on little-endian hosts. d and s may be the same.
+ * Whole registers are swapped with a byte shuffle where AVX2 or SSSE3 is
+ * available, and with word shuffles and shifts on plain SSE2.
+ */
+static void _peb_vec_swap(char* d, const char* s, size_t n, int width)
+{
+    size_t      i = 0;
+    int         j;
+    char        c[8];
+
+#ifdef WORDS_BIGENDIAN
+    if ( d != s ) {
+        memmove(d, s, n);
+    }
+    return;
+#endif
+
+#if defined(__AVX2__)
+    {
+        __m256i     mask;
+
+        if ( width == 8 ) {
+            mask = _mm256_setr_epi8(7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8,
+                                    7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8);
+        }
+        else if ( width == 4 ) {
+            mask = _mm256_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+                                    3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+        }
+        else {
+            mask = _mm256_setr_epi8(1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14,
+                                    1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14);
+        }
+
+        for ( ; i + 32 <= n; i += 32 ) {
+            _mm256_storeu_si256((__m256i*) (d + i),
+                    _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*) (s + i)), mask));
+        }
+    }
+#elif defined(__SSSE3__)
+    {
+        __m128i     mask;
+
+        if ( width == 8 ) {
+            mask = _mm_setr_epi8(7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8);
+        }
+        else if ( width == 4 ) {
+            mask = _mm_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+        }
+        else {
+            mask = _mm_setr_epi8(1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14);
+        }
+
+        for ( ; i + 16 <= n; i += 16 ) {
+            _mm_storeu_si128((__m128i*) (d + i),
+                    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (s + i)), mask));
+        }
+    }
+#elif defined(__SSE2__)
+    /* Baseline x86-64: reorder the 16-bit words, then swap the bytes of each */
+    {
+        __m128i     v;
+
+        for ( ; i + 16 <= n; i += 16 ) {
+            v = _mm_loadu_si128((const __m128i*) (s + i));
+            if ( width == 8 ) {
+                v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(0,1,2,3)), _MM_SHUFFLE(0,1,2,3));
+            }
+            else if ( width == 4 ) {
+                v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2,3,0,1)), _MM_SHUFFLE(2,3,0,1));
+            }
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            _mm_storeu_si128((__m128i*) (d + i), v);
+        }
+    }
+#endif
+
+    for ( ; i + width <= n; i += width ) {
+        for ( j = 0; j < width; j++ ) {
+            c[j] = s[i + width - 1 - j];
+        }
+        memcpy(d + i, c, width);
+    }
+}
+
+/*
+ * Packs a numeric array into a binary of big-endian elements, to be sent
+ * with ~b and matched as <<X:64/float, ...>> on the Erlang side
+ *
+ * Prototype:
+ *      string peb_pack_vector(array values, string type)
+ *
+ * Parameters:
+ *      values          numbers, converted to the type
+ *      type            float64, float32, int64, int32 or int16
+ *
+ * Return:
+ *     string           the packed elements in array order
+ *     false            unknown type
+ */
+PHP_FUNCTION(peb_pack_vector)
+{
+    zval*           values;
+    zval*           pdata;
+    char*           type;
+    size_t          type_len;
+    zend_string*    str;
+    char*           d;
+    int             code, width;
+    uint32_t        count;
+    double          dv;
+    float           fv;
+    int64_t         lv;
+    int32_t         iv;
+    int16_t         sv;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "as", &values, &type, &type_len) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    if ( (code=_peb_vec_type(type, type_len, &width)) == 0 ) {
+        PEB_G(errorno) = PEB_ERRORNO_VECTOR;
+        PEB_G(error) = estrdup(PEB_ERROR_VECTOR);
+        RETURN_FALSE;
+    }
+
+    count = zend_hash_num_elements(Z_ARRVAL_P(values));
+    str = zend_string_safe_alloc(count, width, 0, 0);
+    d = ZSTR_VAL(str);
+
+    /* Native values first, then one pass over the whole blob to swap them */
+    ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(values), pdata) {
+        ZVAL_DEREF(pdata);
+        switch ( code ) {
+            case PEB_VEC_FLOAT64:
+                dv = Z_TYPE_P(pdata) == IS_DOUBLE ? Z_DVAL_P(pdata) : zval_get_double(pdata);
+                memcpy(d, &dv, 8);
+                break;
+            case PEB_VEC_FLOAT32:
+                fv = (float) (Z_TYPE_P(pdata) == IS_DOUBLE ? Z_DVAL_P(pdata) : zval_get_double(pdata));
+                memcpy(d, &fv, 4);
+                break;
+            case PEB_VEC_INT64:
+                lv = Z_TYPE_P(pdata) == IS_LONG ? Z_LVAL_P(pdata) : zval_get_long(pdata);
+                memcpy(d, &lv, 8);
+                break;
+            case PEB_VEC_INT32:
+                iv = (int32_t) (Z_TYPE_P(pdata) == IS_LONG ? Z_LVAL_P(pdata) : zval_get_long(pdata));
+                memcpy(d, &iv, 4);
+                break;
+            default:
+                sv = (int16_t) (Z_TYPE_P(pdata) == IS_LONG ? Z_LVAL_P(pdata) : zval_get_long(pdata));
+                memcpy(d, &sv, 2);
+                break;
+        }
+        d += width;
+    } ZEND_HASH_FOREACH_END();
+
+    _peb_vec_swap(ZSTR_VAL(str), ZSTR_VAL(str), ZSTR_LEN(str), width);
+    ZSTR_VAL(str)[ZSTR_LEN(str)] = '\0';
+
+    RETURN_NEW_STR(str);
+}
+
+/*
+ * Unpacks a binary of big-endian elements into a packed array
+ *
+ * Prototype:
+ *      array peb_unpack_vector(string blob, string type)
+ *
+ * Parameters:
+ *      blob            packed elements, as made by peb_pack_vector() or
+ *                      <<X:64/float, ...>> on the Erlang side
+ *      type            float64, float32, int64, int32 or int16
+ *
+ * Return:
+ *     array            the elements as floats or integers
+ *     false            unknown type or a blob size that is not a multiple
+ *                      of the element size
+ */
+PHP_FUNCTION(peb_unpack_vector)
+{
+    char*           blob;
+    size_t          blob_len;
+    char*           type;
+    size_t          type_len;
+    int             code, width;
+    size_t          i, j, n;
+    zval            z;
+    double          dv;
+    float           fv;
+    int64_t         lv;
+    int32_t         iv;
+    int16_t         sv;
+    char            chunk[512];
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "ss", &blob, &blob_len, &type, &type_len) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    if ( (code=_peb_vec_type(type, type_len, &width)) == 0 || blob_len % width != 0 ||
+            blob_len / width > UINT32_MAX ) {
+        PEB_G(errorno) = PEB_ERRORNO_VECTOR;
+        PEB_G(error) = estrdup(PEB_ERROR_VECTOR);
+        RETURN_FALSE;
+    }
+
+    _peb_array_init_packed(return_value, (uint32_t) (blob_len / width));
+
+    /* Swapped a chunk at a time into native order, then filled in place */
+    for ( i = 0; i < blob_len; i += n ) {
+        n = blob_len - i < sizeof(chunk) ? blob_len - i : sizeof(chunk);
+        _peb_vec_swap(chunk, blob + i, n, width);
+
+        ZEND_HASH_FILL_PACKED(Z_ARRVAL_P(return_value)) {
+            for ( j = 0; j < n; j += width ) {
+                switch ( code ) {
+                    case PEB_VEC_FLOAT64:
+                        memcpy(&dv, chunk + j, 8);
+                        ZVAL_DOUBLE(&z, dv);
+                        break;
+                    case PEB_VEC_FLOAT32:
+                        memcpy(&fv, chunk + j, 4);
+                        ZVAL_DOUBLE(&z, fv);
+                        break;
+                    case PEB_VEC_INT64:
+                        memcpy(&lv, chunk + j, 8);
+                        ZVAL_LONG(&z, (zend_long) lv);
+                        break;
+                    case PEB_VEC_INT32:
+                        memcpy(&iv, chunk + j, 4);
+                        ZVAL_LONG(&z, iv);
+                        break;
+                    default:
+                        memcpy(&sv, chunk + j, 2);
+                        ZVAL_LONG(&z, sv);
+                        break;
+                }
+                ZEND_HASH_FILL_ADD(&z);
+            }
+        } ZEND_HASH_FILL_END();
+    }
+}
+
+/*
+ * JSON transcoding. Terms are written as JSON straight from the buffer and
+ * JSON is parsed straight into the external term format, no zvals are built
+ * in between. Containers keep a frame on the codec stack like the decoder.
+ */
+
+/*
+ * Writes bytes as a JSON string. Latin-1 bytes (strings) are widened to
+ * UTF-8, other bytes (atom names, binaries) must be valid UTF-8 and are
+ * copied. Runs
+ * that need no escaping are found 16 bytes at a time where SSE2 is available
+ * and copied at once.
+ */
+static int _peb_json_put_str(smart_str* buf, const unsigned char* p, size_t n, int latin1)
+{
+    static const char   hex[] = "0123456789abcdef";
+    size_t              i = 0, run;
+    unsigned char       c;
+    int                 len;
+#ifdef __SSE2__
+    const __m128i       quote = _mm_set1_epi8('"');
+    const __m128i       bslash = _mm_set1_epi8('\\');
+    const __m128i       space = _mm_set1_epi8(0x20);
+    __m128i             v;
+#endif
+
+    smart_str_appendc(buf, '"');
+
+    while ( i < n ) {
+        run = i;
+#ifdef __SSE2__
+        /* Bytes of 0x80 and up compare as negative, so below the space */
+        while ( i + 16 <= n ) {
+            v = _mm_loadu_si128((const __m128i*) (p + i));
+            if ( _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                    _mm_cmpeq_epi8(v, bslash)), _mm_cmplt_epi8(v, space))) != 0 ) {
+                break;
+            }
+            i += 16;
+        }
+#endif
+        while ( i < n && p[i] >= 0x20 && p[i] < 0x80 && p[i] != '"' && p[i] != '\\' ) {
+            i++;
+        }
+        if ( i > run ) {
+            smart_str_appendl(buf, (const char*) p + run, i - run);
+        }
+        if ( i == n ) {
+            break;
+        }
+
+        c = p[i];
+        if ( c >= 0x80 ) {
+            if ( latin1 ) {
+                smart_str_appendc(buf, (char) (0xc0 | (c >> 6)));
+                smart_str_appendc(buf, (char) (0x80 | (c & 0x3f)));
+                i++;
+            }
+            else if ( (len=_peb_utf8_len(p + i, n - i)) == 0 ) {
+                return FAILURE;
+            }
+            else {
+                smart_str_appendl(buf, (const char*) p + i, len);
+                i += len;
+            }
+            continue;
+        }
+
+        smart_str_appendc(buf, '\\');
+        switch ( c ) {
+            case '"':   smart_str_appendc(buf, '"');    break;
+            case '\\':  smart_str_appendc(buf, '\\');   break;
+            case '\b':  smart_str_appendc(buf, 'b');    break;
+            case '\f':  smart_str_appendc(buf, 'f');    break;
+            case '\n':  smart_str_appendc(buf, 'n');    break;
+            case '\r':  smart_str_appendc(buf, 'r');    break;
+            case '\t':  smart_str_appendc(buf, 't');    break;
+            default:
+                smart_str_appendl(buf, "u00", 3);
+                smart_str_appendc(buf, hex[c >> 4]);
+                smart_str_appendc(buf, hex[c & 0xf]);
+                break;
+        }
+        i++;
+    }
+
+    smart_str_appendc(buf, '"');
+
+    return SUCCESS;
+}
+
+/*
+ * Floats follow serialize_precision like json_encode(), and keep a
+ * fraction so they come back as floats
+ */
+static void _peb_json_put_double(smart_str* buf, double d)
+{
+    size_t      start = buf->s != NULL ? ZSTR_LEN(buf->s) : 0;
+    size_t      i;
+
+    smart_str_append_printf(buf, "%.*H", (int) PG(serialize_precision), d);
+
+    for ( i = start; i < ZSTR_LEN(buf->s); i++ ) {
+        if ( ZSTR_VAL(buf->s)[i] == '.' || ZSTR_VAL(buf->s)[i] == 'e' || ZSTR_VAL(buf->s)[i] == 'E' ) {
+            return;
+        }
+    }
+    smart_str_appendl(buf, ".0", 2);
+}
+
+/*
+ * Writes a map or proplist key as a JSON object key, the same keys as
+ * _peb_decode_key() accepts
+ */
+static int _peb_json_put_key(ei_x_buff* x, smart_str* buf)
+{
+    zend_string*    str;
+    long            long_value;
+    int             type, size, hdr, result;
+
+    if ( ei_get_type(x->buff, &x->index, &type, &size) < 0 ) {
+        return FAILURE;
+    }
+
+    switch ( type ) {
+        case ERL_SMALL_INTEGER_EXT:
+        case ERL_INTEGER_EXT:
+        case ERL_SMALL_BIG_EXT:
+            if ( ei_decode_long(x->buff, &x->index, &long_value) < 0 ) {
+                return FAILURE;
+            }
+            smart_str_appendc(buf, '"');
+            smart_str_append_long(buf, long_value);
+            smart_str_appendc(buf, '"');
+            break;
+
+        case ERL_ATOM_EXT:
+            if ( (str=_peb_decode_atom(x, size)) == NULL ) {
+                return FAILURE;
+            }
+            /* _peb_decode_atom() already gives UTF-8 */
+            result = _peb_json_put_str(buf, (const unsigned char*) ZSTR_VAL(str), ZSTR_LEN(str), 0);
+            zend_string_release(str);
+            return result;
+
+        case ERL_STRING_EXT:
+        case ERL_BINARY_EXT:
+            hdr = type == ERL_STRING_EXT ? 3 : 5;
+            if ( size < 0 || size > x->buffsz - x->index - hdr ) {
+                return FAILURE;
+            }
+            result = _peb_json_put_str(buf, (const unsigned char*) x->buff + x->index + hdr, size,
+                    type == ERL_STRING_EXT);
+            x->index += hdr + size;
+            return result;
+
+        default:
+            return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Writes the term at x->index as JSON. Numbers stay numbers, bignums are
+ * written with all their digits. Atoms are strings except true, false and
+ * undefined/null, which keep their JSON meaning unless PEB_OPT_JSON_PLAIN_ATOMS
+ * is given. Strings and binaries are strings, binaries that are not UTF-8
+ * fail unless PEB_OPT_JSON_BASE64 writes every binary as base64. Lists and
+ * tuples are arrays, or {"tuple": [...]} objects for tuples with
+ * PEB_OPT_JSON_TUPLES. Maps are objects, and so are proplists with
+ * PEB_OPT_PROPLISTS. Pids, refs, ports and funs are written as strings in
+ * their printed form.
+ */
+static int _peb_term_to_json(ei_x_buff* x, smart_str* buf, int flags)
+{
+    peb_json_frame*         stack = _peb_stack_reserve(0);
+    peb_json_frame*         frame;
+    uint32_t                sp = 0;
+    const unsigned char*    p;
+    unsigned char           tag;
+    zend_string*            str;
+    zval                    z;
+    char*                   s;
+    int                     size, kind, index;
+    double                  double_value;
+    uint64_t                bits;
+
+    while ( 1 ) {
+        if ( sp > 0 ) {
+            frame = &stack[sp-1];
+            if ( frame->count++ > 0 ) {
+                smart_str_appendc(buf, ',');
+            }
+            if ( frame->kind != PEB_JSON_ARRAY ) {
+                if ( frame->kind == PEB_JSON_PROPLIST && ei_decode_tuple_header(x->buff, &x->index, &size) < 0 ) {
+                    goto failure;
+                }
+                if ( _peb_json_put_key(x, buf) != SUCCESS ) {
+                    goto failure;
+                }
+                smart_str_appendc(buf, ':');
+            }
+        }
+
+        if ( x->index >= x->buffsz ) {
+            goto failure;
+        }
+        p = (const unsigned char*) x->buff + x->index;
+        tag = *p;
+
+        switch ( peb_term_class[tag] ) {
+            case PEB_T_SMALL_INT:
+                if ( x->buffsz - x->index < 2 ) {
+                    goto failure;
+                }
+                smart_str_append_long(buf, p[1]);
+                x->index += 2;
+                break;
+
+            case PEB_T_INT:
+                if ( x->buffsz - x->index < 5 ) {
+                    goto failure;
+                }
+                smart_str_append_long(buf, (int32_t) _peb_get32be(p + 1));
+                x->index += 5;
+                break;
+
+            case PEB_T_NEW_FLOAT:
+                if ( x->buffsz - x->index < 9 ) {
+                    goto failure;
+                }
+                bits = ((uint64_t) _peb_get32be(p + 1) << 32) | _peb_get32be(p + 5);
+                memcpy(&double_value, &bits, sizeof(double));
+                _peb_json_put_double(buf, double_value);
+                x->index += 9;
+                break;
+
+            case PEB_T_FLOAT:
+                if ( ei_decode_double(x->buff, &x->index, &double_value) < 0 ) {
+                    goto failure;
+                }
+                _peb_json_put_double(buf, double_value);
+                break;
+
+            case PEB_T_BIG:
+                /* JSON numbers have no range, the digits are written as they are */
+                if ( _peb_decode_big(x, &z) != SUCCESS ) {
+                    goto failure;
+                }
+                if ( Z_TYPE(z) == IS_LONG ) {
+                    smart_str_append_long(buf, Z_LVAL(z));
+                }
+                else {
+                    smart_str_append(buf, Z_STR(z));
+                    zval_ptr_dtor(&z);
+                }
+                break;
+
+            case PEB_T_ATOM:
+                if ( tag == ERL_SMALL_ATOM_EXT || tag == ERL_SMALL_ATOM_UTF8_EXT ) {
+                    if ( x->buffsz - x->index < 2 ) {
+                        goto failure;
+                    }
+                    size = p[1];
+                }
+                else {
+                    if ( x->buffsz - x->index < 3 ) {
+                        goto failure;
+                    }
+                    size = (p[1] << 8) | p[2];
+                }
+                if ( (str=_peb_decode_atom(x, size)) == NULL ) {
+                    goto failure;
+                }
+                if ( (flags & PEB_OPT_JSON_PLAIN_ATOMS) == 0 && zend_string_equals_literal(str, "true") ) {
+                    smart_str_appendl(buf, "true", 4);
+                }
+                else if ( (flags & PEB_OPT_JSON_PLAIN_ATOMS) == 0 && zend_string_equals_literal(str, "false") ) {
+                    smart_str_appendl(buf, "false", 5);
+                }
+                else if ( (flags & PEB_OPT_JSON_PLAIN_ATOMS) == 0 &&
+                        (zend_string_equals_literal(str, "undefined") || zend_string_equals_literal(str, "null")) ) {
+                    smart_str_appendl(buf, "null", 4);
+                }
+                else if ( _peb_json_put_str(buf, (const unsigned char*) ZSTR_VAL(str), ZSTR_LEN(str), 0) != SUCCESS ) {
+                    zend_string_release(str);
+                    goto failure;
+                }
+                zend_string_release(str);
+                break;
+
+            case PEB_T_STRING:
+                if ( x->buffsz - x->index < 3 ) {
+                    goto failure;
+                }
+                size = (p[1] << 8) | p[2];
+                if ( size > x->buffsz - x->index - 3 ) {
+                    goto failure;
+                }
+                _peb_json_put_str(buf, p + 3, size, 1);
+                x->index += 3 + size;
+                break;
+
+            case PEB_T_BINARY:
+                if ( x->buffsz - x->index < 5 || (size=(int) _peb_get32be(p + 1)) < 0 ||
+                        size > x->buffsz - x->index - 5 ) {
+                    goto failure;
+                }
+                if ( flags & PEB_OPT_JSON_BASE64 ) {
+                    str = php_base64_encode(p + 5, size);
+                    smart_str_appendc(buf, '"');
+                    smart_str_append(buf, str);
+                    smart_str_appendc(buf, '"');
+                    zend_string_free(str);
+                }
+                else if ( _peb_json_put_str(buf, p + 5, size, 0) != SUCCESS ) {
+                    goto failure;
+                }
+                x->index += 5 + size;
+                break;
+
+            case PEB_T_PID:
+            case PEB_T_OPAQUE:
+                /* ei_s_print_term() always hands back a malloc()ed string */
+                index = x->index;
+                s = NULL;
+                if ( ei_s_print_term(&s, x->buff, &index) < 0 ) {
+                    free(s);
+                    goto failure;
+                }
+                _peb_json_put_str(buf, (const unsigned char*) s, strlen(s), 1);
+                free(s);
+                x->index = index;
+                break;
+
+            case PEB_T_NIL:
+                smart_str_appendl(buf, "[]", 2);
+                x->index += 1;
+                break;
+
+            case PEB_T_LIST:
+            case PEB_T_TUPLE:
+            case PEB_T_MAP:
+                if ( tag == ERL_LIST_EXT && (flags & PEB_OPT_CHARLISTS) && _peb_decode_charlist(x, &z) == SUCCESS ) {
+                    _peb_json_put_str(buf, (const unsigned char*) Z_STRVAL(z), Z_STRLEN(z), 0);
+                    zval_ptr_dtor(&z);
+                    break;
+                }
+
+                if ( tag == ERL_LIST_EXT ) {
+                    kind = (flags & PEB_OPT_PROPLISTS) && _peb_is_proplist(x->buff, x->index)
+                            ? PEB_JSON_PROPLIST : PEB_JSON_ARRAY;
+                    if ( ei_decode_list_header(x->buff, &x->index, &size) < 0 ) {
+                        goto failure;
+                    }
+                }
+                else if ( tag == ERL_MAP_EXT ) {
+                    kind = PEB_JSON_OBJECT;
+                    if ( ei_decode_map_header(x->buff, &x->index, &size) < 0 ) {
+                        goto failure;
+                    }
+                }
+                else {
+                    kind = PEB_JSON_ARRAY;
+                    if ( ei_decode_tuple_header(x->buff, &x->index, &size) < 0 ) {
+                        goto failure;
+                    }
+                    if ( flags & PEB_OPT_JSON_TUPLES ) {
+                        smart_str_appendl(buf, "{\"tuple\":", 9);
+                    }
+                }
+
+                if ( size == 0 ) {
+                    smart_str_appendl(buf, kind == PEB_JSON_ARRAY ? "[]" : "{}", 2);
+                    if ( tag != ERL_LIST_EXT && tag != ERL_MAP_EXT && (flags & PEB_OPT_JSON_TUPLES) ) {
+                        smart_str_appendc(buf, '}');
+                    }
+                    break;
+                }
+
+                /* Every element takes at least one byte */
+                if ( size > x->buffsz - x->index ) {
+                    goto failure;
+                }
+
+                if ( sp >= PEB_G(max_depth) ) {
+                    PEB_G(errorno) = PEB_ERRORNO_DEPTH;
+                    PEB_G(error) = estrdup(PEB_ERROR_DEPTH);
+                    goto failure;
+                }
+
+                stack = _peb_stack_reserve((sp + 1) * sizeof(peb_json_frame));
+                frame = &stack[sp++];
+                frame->remaining = size;
+                frame->count = 0;
+                frame->kind = kind;
+                frame->is_list = tag == ERL_LIST_EXT;
+                frame->is_tuple = tag != ERL_LIST_EXT && tag != ERL_MAP_EXT;
+                smart_str_appendc(buf, kind == PEB_JSON_ARRAY ? '[' : '{');
+                continue;
+
+            default:
+                goto failure;
+        }
+
+        /* Close every array and object that has just got its last element */
+        while ( sp > 0 && --stack[sp-1].remaining == 0 ) {
+            frame = &stack[sp-1];
+
+            if ( frame->is_list ) {
+                if ( x->index < x->buffsz &&
+                        peb_term_class[(unsigned char) x->buff[x->index]] != PEB_T_LIST &&
+                        peb_term_class[(unsigned char) x->buff[x->index]] != PEB_T_NIL ) {
+                    /* Improper list, JSON has no way to keep the tail apart */
+                    goto failure;
+                }
+
+                /* The tail is either [] or a continuation of the list */
+                if ( ei_decode_list_header(x->buff, &x->index, &size) < 0 ) {
+                    goto failure;
+                }
+                if ( size > 0 ) {
+                    if ( size > x->buffsz - x->index ) {
+                        goto failure;
+                    }
+                    frame->remaining = size;
+                    break;
+                }
+            }
+
+            smart_str_appendc(buf, frame->kind == PEB_JSON_ARRAY ? ']' : '}');
+            if ( frame->is_tuple && (flags & PEB_OPT_JSON_TUPLES) ) {
+                smart_str_appendc(buf, '}');
+            }
+            sp--;
+        }
+
+        if ( sp == 0 ) {
+            return SUCCESS;
+        }
+    }
+
+failure:
+    if ( PEB_G(errorno) == 0 ) {
+        PEB_G(errorno) = PEB_ERRORNO_JSON;
+        PEB_G(error) = estrdup(PEB_ERROR_JSON);
+    }
+
+    return FAILURE;
+}
+
+static zend_always_inline const char* _peb_json_ws(const char* p, const char* end)
+{
+    while ( p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') ) {
+        p++;
+    }
+
+    return p;
+}
+
+static int _peb_json_hex4(const unsigned char* p, const unsigned char* end, uint32_t* cp)
+{
+    int         i;
+    uint32_t    v = 0;
+
+    if ( end - p < 4 ) {
+        return FAILURE;
+    }
+
+    for ( i = 0; i < 4; i++ ) {
+        v <<= 4;
+        if ( p[i] >= '0' && p[i] <= '9' ) {
+            v |= p[i] - '0';
+        }
+        else if ( (p[i] | 0x20) >= 'a' && (p[i] | 0x20) <= 'f' ) {
+            v |= (p[i] | 0x20) - 'a' + 10;
+        }
+        else {
+            return FAILURE;
+        }
+    }
+    *cp = v;
+
+    return SUCCESS;
+}
+
+/*
+ * Unescapes the JSON string at *pp, just past its opening quote, straight
+ * into the buffer behind hdr bytes left for the caller to fill in. The
+ * string must be valid UTF-8. Returns its length in bytes or -1.
+ */
+static zend_long _peb_json_get_str(const char** pp, const char* end, ei_x_buff* x, int hdr)
+{
+    const unsigned char*    p = (const unsigned char*) *pp;
+    const unsigned char*    e = (const unsigned char*) end;
+    const unsigned char*    run;
+    char*                   s;
+    char*                   d;
+    uint32_t                cp, lo;
+    int                     start, len;
+
+    if ( _peb_x_reserve(x, hdr) == NULL ) {
+        return -1;
+    }
+    x->index += hdr;
+    start = x->index;
+
+    while ( 1 ) {
+        for ( run = p; p < e && *p != '"' && *p != '\\' && *p >= 0x20; p += len ) {
+            if ( (len=_peb_utf8_len(p, e - p)) == 0 ) {
+                return -1;
+            }
+        }
+        if ( p > run ) {
+            if ( (s=_peb_x_reserve(x, p - run)) == NULL ) {
+                return -1;
+            }
+            memcpy(s, run, p - run);
+            x->index += p - run;
+        }
+
+        if ( p >= e || *p < 0x20 ) {
+            return -1;
+        }
+        if ( *p++ == '"' ) {
+            break;
+        }
+
+        /* An escape, at most four UTF-8 bytes */
+        if ( p >= e || (s=_peb_x_reserve(x, 4)) == NULL ) {
+            return -1;
+        }
+        switch ( *p++ ) {
+            case '"':   *s = '"';   break;
+            case '\\':  *s = '\\';  break;
+            case '/':   *s = '/';   break;
+            case 'b':   *s = '\b';  break;
+            case 'f':   *s = '\f';  break;
+            case 'n':   *s = '\n';  break;
+            case 'r':   *s = '\r';  break;
+            case 't':   *s = '\t';  break;
+            case 'u':
+                if ( _peb_json_hex4(p, e, &cp) != SUCCESS ) {
+                    return -1;
+                }
+                p += 4;
+                if ( cp >= 0xd800 && cp <= 0xdbff ) {
+                    if ( e - p < 6 || p[0] != '\\' || p[1] != 'u' || _peb_json_hex4(p + 2, e, &lo) != SUCCESS ||
+                            lo < 0xdc00 || lo > 0xdfff ) {
+                        return -1;
+                    }
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    p += 6;
+                }
+                else if ( cp >= 0xdc00 && cp <= 0xdfff ) {
+                    return -1;
+                }
+                d = _peb_put_utf8(s, cp);
+                x->index += d - s - 1;
+                break;
+            default:
+                return -1;
+        }
+        x->index += 1;
+    }
+
+    *pp = (const char*) p;
+
+    return x->index - start;
+}
+
+/*
+ * JSON strings are written as binaries, and object keys as atoms with
+ * PEB_OPT_ATOM_KEYS
+ */
+static int _peb_json_binary(const char** pp, const char* end, ei_x_buff* x)
+{
+    int         hdr = x->index;
+    zend_long   len;
+
+    if ( (len=_peb_json_get_str(pp, end, x, 5)) < 0 || len > UINT32_MAX ) {
+        return FAILURE;
+    }
+    x->buff[hdr] = ERL_BINARY_EXT;
+    _peb_put32be(x->buff + hdr + 1, (uint32_t) len);
+
+    return SUCCESS;
+}
+
+static int _peb_json_key(const char** pp, const char* end, ei_x_buff* x, peb_json_frame* frame, int flags)
+{
+    const char*     p = _peb_json_ws(*pp, end);
+    int             hdr, latin1;
+    zend_long       len;
+
+    if ( p >= end || *p++ != '"' ) {
+        return FAILURE;
+    }
+
+    if ( frame->kind == PEB_JSON_PROPLIST && _peb_x_put_pair(x) != SUCCESS ) {
+        return FAILURE;
+    }
+
+    hdr = x->index;
+    if ( flags & PEB_OPT_ATOM_KEYS ) {
+        /* The key is valid UTF-8 by now, only its character count matters */
+        if ( (len=_peb_json_get_str(&p, end, x, 3)) < 0 ||
+                _peb_atom_utf8_len(x->buff + hdr + 3, (size_t) len, &latin1) < 0 ) {
+            return FAILURE;
+        }
+        x->buff[hdr] = ERL_ATOM_UTF8_EXT;
+        _peb_put16be(x->buff + hdr + 1, (uint32_t) len);
+    }
+    else if ( _peb_json_binary(&p, end, x) != SUCCESS ) {
+        return FAILURE;
+    }
+    else {
+        len = x->index - hdr - 5;
+    }
+
+    p = _peb_json_ws(p, end);
+    if ( p >= end || *p++ != ':' ) {
+        return FAILURE;
+    }
+
+    /* {"tuple": [...]} is turned back into a tuple when it is closed */
+    if ( (flags & PEB_OPT_JSON_TUPLES) && frame->count == 0 && len == 5 &&
+            memcmp(x->buff + x->index - 5, "tuple", 5) == 0 ) {
+        frame->value_at = x->index;
+    }
+
+    *pp = p;
+
+    return SUCCESS;
+}
+
+static int _peb_json_number(const char** pp, const char* end, ei_x_buff* x)
+{
+    const char*     p = *pp;
+    const char*     start = p;
+    int             is_double = 0;
+    zend_long       long_value;
+
+    if ( p < end && *p == '-' ) {
+        p++;
+    }
+    if ( p >= end || *p < '0' || *p > '9' ) {
+        return FAILURE;
+    }
+    if ( *p == '0' ) {
+        p++;
+    }
+    else {
+        while ( p < end && *p >= '0' && *p <= '9' ) {
+            p++;
+        }
+    }
+    if ( p < end && *p == '.' ) {
+        is_double = 1;
+        if ( ++p >= end || *p < '0' || *p > '9' ) {
+            return FAILURE;
+        }
+        while ( p < end && *p >= '0' && *p <= '9' ) {
+            p++;
+        }
+    }
+    if ( p < end && (*p == 'e' || *p == 'E') ) {
+        is_double = 1;
+        if ( ++p < end && (*p == '+' || *p == '-') ) {
+            p++;
+        }
+        if ( p >= end || *p < '0' || *p > '9' ) {
+            return FAILURE;
+        }
+        while ( p < end && *p >= '0' && *p <= '9' ) {
+            p++;
+        }
+    }
+    *pp = p;
+
+    /* Integers out of range become bignums, Erlang has no limit on them */
+    if ( !is_double ) {
+        errno = 0;
+        long_value = ZEND_STRTOL(start, NULL, 10);
+        if ( errno != ERANGE ) {
+            return _peb_x_put_long(x, long_value);
+        }
+        return _peb_x_put_decimal(x, start + (*start == '-'), p - start - (*start == '-'), *start == '-');
+    }
+
+    return _peb_x_put_double(x, zend_strtod(start, NULL));
+}
+
+/*
+ * Ends a JSON array or object. Lists get their [] tail, empty ones are
+ * written as [], and {"tuple": [...]} objects with PEB_OPT_JSON_TUPLES are
+ * rewritten in place as the tuple of the list elements.
+ */
+static int _peb_json_close(ei_x_buff* x, peb_json_frame* frame)
+{
+    char*       s;
+    char*       d;
+    uint32_t    arity;
+    int         elems, len;
+
+    if ( frame->value_at >= 0 && frame->count == 1 &&
+            (x->buff[frame->value_at] == ERL_LIST_EXT || x->buff[frame->value_at] == ERL_NIL_EXT) ) {
+        s = x->buff + frame->value_at;
+        if ( *s == ERL_NIL_EXT ) {
+            arity = 0;
+            elems = frame->value_at + 1;
+            len = 0;
+        }
+        else {
+            /* Written by _peb_json_close(), so a single chunk ending in [] */
+            arity = _peb_get32be((const unsigned char*) s + 1);
+            elems = frame->value_at + 5;
+            len = x->index - 1 - elems;
+        }
+
+        d = x->buff + frame->hdr;
+        if ( arity <= 255 ) {
+            d[0] = ERL_SMALL_TUPLE_EXT;
+            d[1] = (char) arity;
+            d += 2;
+        }
+        else {
+            d[0] = ERL_LARGE_TUPLE_EXT;
+            _peb_put32be(d + 1, arity);
+            d += 5;
+        }
+        memmove(d, x->buff + elems, len);
+        x->index = (int) (d + len - x->buff);
+
+        return SUCCESS;
+    }
+
+    if ( frame->kind != PEB_JSON_OBJECT ) {
+        if ( frame->count == 0 ) {
+            x->index = frame->hdr;
+        }
+        if ( _peb_x_put_nil(x) != SUCCESS ) {
+            return FAILURE;
+        }
+        if ( frame->count == 0 ) {
+            return SUCCESS;
+        }
+    }
+
+    return _peb_x_close(x, frame->hdr, frame->count);
+}
+
+/*
+ * Parses JSON text into the external term format. Objects become maps with
+ * binary keys, atom keys with PEB_OPT_ATOM_KEYS, or proplists with
+ * PEB_OPT_PROPLISTS. Arrays become lists, strings binaries, true, false and
+ * null the atoms true, false and undefined. With PEB_OPT_JSON_TUPLES
+ * {"tuple": [...]} objects become tuples.
+ */
+static int _peb_json_to_term(const char* json, size_t json_len, ei_x_buff* x, int flags)
+{
+    peb_json_frame* stack = _peb_stack_reserve(0);
+    peb_json_frame* frame;
+    uint32_t        sp = 0;
+    const char*     p = json;
+    const char*     end = json + json_len;
+    int             result;
+
+    while ( 1 ) {
+        p = _peb_json_ws(p, end);
+        if ( p >= end ) {
+            goto failure;
+        }
+
+        switch ( *p ) {
+            case '[':
+            case '{':
+                if ( sp >= PEB_G(max_depth) ) {
+                    PEB_G(errorno) = PEB_ERRORNO_DEPTH;
+                    PEB_G(error) = estrdup(PEB_ERROR_DEPTH);
+                    goto failure;
+                }
+
+                stack = _peb_stack_reserve((sp + 1) * sizeof(peb_json_frame));
+                frame = &stack[sp++];
+                frame->kind = *p == '[' ? PEB_JSON_ARRAY :
+                        (flags & PEB_OPT_PROPLISTS) ? PEB_JSON_PROPLIST : PEB_JSON_OBJECT;
+                frame->count = 0;
+                frame->value_at = -1;
+                if ( (frame->hdr=_peb_x_open(x, frame->kind == PEB_JSON_OBJECT ? ERL_MAP_EXT : ERL_LIST_EXT)) < 0 ) {
+                    goto failure;
+                }
+
+                p = _peb_json_ws(p + 1, end);
+                if ( p < end && *p == (frame->kind == PEB_JSON_ARRAY ? ']' : '}') ) {
+                    p++;
+                    if ( _peb_json_close(x, frame) != SUCCESS ) {
+                        goto failure;
+                    }
+                    sp--;
+                    break;
+                }
+
+                if ( frame->kind != PEB_JSON_ARRAY && _peb_json_key(&p, end, x, frame, flags) != SUCCESS ) {
+                    goto failure;
+                }
+                frame->count = 1;
+                continue;
+
+            case '"':
+                p++;
+                result = _peb_json_binary(&p, end, x);
+                break;
+
+            case 't':
+                result = end - p >= 4 && memcmp(p, "true", 4) == 0 ? _peb_x_put_atom(x, "true", 4) : FAILURE;
+                p += 4;
+                break;
+
+            case 'f':
+                result = end - p >= 5 && memcmp(p, "false", 5) == 0 ? _peb_x_put_atom(x, "false", 5) : FAILURE;
+                p += 5;
+                break;
+
+            case 'n':
+                result = end - p >= 4 && memcmp(p, "null", 4) == 0 ? _peb_x_put_atom(x, "undefined", 9) : FAILURE;
+                p += 4;
+                break;
+
+            default:
+                result = _peb_json_number(&p, end, x);
+                break;
+        }
+
+        if ( result != SUCCESS ) {
+            goto failure;
+        }
+
+        /* After a value comes the next element or the end of its container */
+        while ( sp > 0 ) {
+            frame = &stack[sp-1];
+            p = _peb_json_ws(p, end);
+            if ( p >= end ) {
+                goto failure;
+            }
+
+            if ( *p == ',' ) {
+                p++;
+                if ( frame->kind != PEB_JSON_ARRAY && _peb_json_key(&p, end, x, frame, flags) != SUCCESS ) {
+                    goto failure;
+                }
+                frame->count++;
+                break;
+            }
+
+            if ( *p++ != (frame->kind == PEB_JSON_ARRAY ? ']' : '}') || _peb_json_close(x, frame) != SUCCESS ) {
+                goto failure;
+            }
+            sp--;
+        }
+
+        if ( sp == 0 ) {
+            if ( _peb_json_ws(p, end) != end ) {
+                goto failure;
+            }
+            return SUCCESS;
+        }
+    }
+
+failure:
+    if ( PEB_G(errorno) == 0 ) {
+        PEB_G(errorno) = PEB_ERRORNO_JSON;
+        PEB_G(error) = estrdup(PEB_ERROR_JSON);
+    }
+
+    return FAILURE;
+}
+
+/*
+ * Writes a term as JSON text, without decoding it to PHP values first
+ *
+ * Prototype:
+ *      string peb_term_to_json(mixed term [, int options])
+ *
+ * Parameters:
+ *      term            message resource or PebTerm
+ *      options         PEB_JSON_PLAIN_ATOMS to write true, false and
+ *                      undefined as strings, PEB_JSON_BASE64 to write
+ *                      binaries as base64, PEB_JSON_TUPLES to write tuples
+ *                      as {"tuple": [...]}, PEB_PROPLISTS to write
+ *                      proplists as objects, PEB_CHARLISTS to write lists
+ *                      of code points as strings
+ *
+ * Return:
+ *     string           JSON text
+ *     false            the term has no JSON equivalent
+ */
+PHP_FUNCTION(peb_term_to_json)
+{
+    zval*           term;
+    zend_long       flags = 0;
+    ei_x_buff*      x;
+    ei_x_buff       view;
+    smart_str       buf = {0};
+    int             index;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "z|l", &term, &flags) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    if ( (x=_peb_term_arg(term, &index)) == NULL ) {
+        RETURN_FALSE;
+    }
+
+    view = *x;
+    view.index = index;
+
+    if ( _peb_term_to_json(&view, &buf, (int) flags) != SUCCESS ) {
+        smart_str_free(&buf);
+        RETURN_FALSE;
+    }
+
+    smart_str_0(&buf);
+    RETURN_NEW_STR(buf.s);
+}
+
+/*
+ * Parses JSON text into an Erlang term, without decoding it to PHP values
+ * first. The term has no version number, like peb_encode_value().
+ *
+ * Prototype:
+ *      resource peb_json_to_term(string json [, int options])
+ *
+ * Parameters:
+ *      json            JSON text
+ *      options         PEB_ATOM_KEYS to write object keys as atoms instead
+ *                      of binaries, PEB_PROPLISTS to write objects as
+ *                      [{Key, Value}] instead of maps, PEB_JSON_TUPLES to
+ *                      write {"tuple": [...]} objects as tuples
+ *
+ * Return:
+ *     messageid        success
+ *     false            invalid JSON
+ */
+PHP_FUNCTION(peb_json_to_term)
+{
+    char*           json;
+    size_t          json_len;
+    zend_long       flags = 0;
+    ei_x_buff*      x;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "s|l", &json, &json_len, &flags) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    x = emalloc(sizeof(ei_x_buff));
+    ei_x_new(x);
+
+    if ( _peb_json_to_term(json, json_len, x, (int) flags) != SUCCESS ) {
+        ei_x_free(x);
+        efree(x);
+        RETURN_FALSE;
+    }
+
+    RETVAL_RES(zend_register_resource(x, le_msgbuff));
+}
+
+/*
+ * Schemas describe a record as a tuple of typed fields, with an optional
+ * tag atom in front:
+ *
+ *  {user, id:int, name:binary, roles:[atom]}
+ *
+ *  int, float, bool, atom, binary, pid - the field types
+ *  string  - a binary, string or charlist, as UTF-8
+ *  term    - any term, decoded like peb_decode()
+ *  @name   - a record of another registered schema
+ *  [T]     - a list of T
+ *  ?T      - T or the atom undefined, which gives null
+ *
+ * They are compiled once and kept per worker, the class and its property
+ * slots are looked up again in every request that uses the schema.
+ */
+static void _peb_schema_dtor(zval* zv)
+{
+    peb_schema*     schema = Z_PTR_P(zv);
+    uint32_t        i;
+
+    for ( i = 0; i < schema->count; i++ ) {
+        zend_string_release(schema->fields[i].name);
+        if ( schema->fields[i].ref != NULL ) {
+            zend_string_release(schema->fields[i].ref);
+        }
+    }
+    zend_string_release(schema->class_name);
+    zend_string_release(schema->spec);
+    if ( schema->tag != NULL ) {
+        zend_string_release(schema->tag);
+    }
+    pefree(schema, 1);
+}
+
+static const char* _peb_schema_ws(const char* p, const char* end)
+{
+    while ( p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') ) {
+        p++;
+    }
+
+    return p;
+}
+
+static const char* _peb_schema_ident(const char* p, const char* end)
+{
+    while ( p < end && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+            (*p >= '0' && *p <= '9') || *p == '_') ) {
+        p++;
+    }
+
+    return p;
+}
+
+static int _peb_schema_type(const char** pp, const char* end, peb_schema_field* field)
+{
+    static const struct {
+        const char*     name;
+        size_t          len;
+        unsigned char   type;
+    } types[] = {
+        { "int",    3, PEB_S_INT },
+        { "float",  5, PEB_S_FLOAT },
+        { "bool",   4, PEB_S_BOOL },
+        { "atom",   4, PEB_S_ATOM },
+        { "binary", 6, PEB_S_BINARY },
+        { "string", 6, PEB_S_STRING },
+        { "pid",    3, PEB_S_PID },
+        { "term",   4, PEB_S_TERM },
+    };
+    const char*     p = _peb_schema_ws(*pp, end);
+    const char*     s;
+    size_t          i;
+
+    if ( p < end && *p == '?' ) {
+        field->nullable = 1;
+        p = _peb_schema_ws(p + 1, end);
+    }
+    if ( p < end && *p == '[' ) {
+        field->is_list = 1;
+        p = _peb_schema_ws(p + 1, end);
+    }
+
+    if ( p < end && *p == '@' ) {
+        s = ++p;
+        if ( (p=_peb_schema_ident(p, end)) == s ) {
+            return FAILURE;
+        }
+        field->type = PEB_S_SCHEMA;
+        field->ref = zend_string_init(s, p - s, 1);
+    }
+    else {
+        s = p;
+        p = _peb_schema_ident(p, end);
+        for ( i = 0; i < sizeof(types) / sizeof(types[0]); i++ ) {
+            if ( (size_t) (p - s) == types[i].len && memcmp(s, types[i].name, types[i].len) == 0 ) {
+                field->type = types[i].type;
+                break;
+            }
+        }
+        if ( field->type == 0 ) {
+            return FAILURE;
+        }
+    }
+
+    if ( field->is_list ) {
+        p = _peb_schema_ws(p, end);
+        if ( p >= end || *p++ != ']' ) {
+            return FAILURE;
+        }
+    }
+
+    *pp = p;
+
+    return SUCCESS;
+}
+
+static peb_schema* _peb_schema_compile(zend_string* class_name, zend_string* spec)
+{
+    const char*         p = ZSTR_VAL(spec);
+    const char*         end = p + ZSTR_LEN(spec);
+    const char*         s;
+    peb_schema*         schema;
+    peb_schema_field*   field;
+    uint32_t            count = 1;
+    zval                zv;
+
+    /* Every field but the last is followed by a comma */
+    for ( s = p; s < end; s++ ) {
+        count += *s == ',';
+    }
+
+    schema = pecalloc(1, sizeof(peb_schema) + (count - 1) * sizeof(peb_schema_field), 1);
+    s = ZSTR_VAL(class_name);
+    if ( ZSTR_LEN(class_name) > 0 && *s == '\\' ) {
+        s++;
+    }
+    schema->class_name = zend_string_init(s, ZSTR_LEN(class_name) - (s - ZSTR_VAL(class_name)), 1);
+    schema->spec = zend_string_init(ZSTR_VAL(spec), ZSTR_LEN(spec), 1);
+    ZVAL_PTR(&zv, schema);
+
+    p = _peb_schema_ws(p, end);
+    if ( p >= end || *p++ != '{' ) {
+        goto failure;
+    }
+
+    while ( 1 ) {
+        s = p = _peb_schema_ws(p, end);
+        if ( (p=_peb_schema_ident(p, end)) == s ) {
+            goto failure;
+        }
+        p = _peb_schema_ws(p, end);
+
+        if ( p < end && *p == ':' ) {
+            field = &schema->fields[schema->count++];
+            field->name = zend_string_init(s, _peb_schema_ident(s, end) - s, 1);
+            zend_string_hash_val(field->name);
+            p++;
+            if ( _peb_schema_type(&p, end, field) != SUCCESS ) {
+                goto failure;
+            }
+            p = _peb_schema_ws(p, end);
+        }
+        else if ( schema->count == 0 && schema->tag == NULL ) {
+            schema->tag = zend_string_init(s, _peb_schema_ident(s, end) - s, 1);
+        }
+        else {
+            goto failure;
+        }
+
+        if ( p < end && *p == ',' ) {
+            p++;
+            continue;
+        }
+        if ( p < end && *p == '}' ) {
+            p++;
+            break;
+        }
+        goto failure;
+    }
+
+    if ( _peb_schema_ws(p, end) != end ) {
+        goto failure;
+    }
+
+    return schema;
+
+failure:
+    _peb_schema_dtor(&zv);
+
+    return NULL;
+}
+
+/*
+ * Finds the class of the schema and the property of every field, once per
+ * request
+ */
+static int _peb_schema_resolve(peb_schema* schema)
+{
+    zend_class_entry*       ce;
+    zend_property_info*     info;
+    uint32_t                i;
+
+    if ( schema->ce != NULL && schema->gen == PEB_G(schema_gen) ) {
+        return SUCCESS;
+    }
+    schema->ce = NULL;
+
+    /* Abstract classes and interfaces are left to object_init_ex() */
+    if ( (ce=zend_lookup_class(schema->class_name)) == NULL ) {
+        return FAILURE;
+    }
+
+    for ( i = 0; i < schema->count; i++ ) {
+        info = zend_hash_find_ptr(&ce->properties_info, schema->fields[i].name);
+        if ( info == NULL || (info->flags & ZEND_ACC_STATIC) ) {
+            return FAILURE;
+        }
+        schema->fields[i].info = info;
+    }
+
+    schema->ce = ce;
+    schema->gen = PEB_G(schema_gen);
+
+    return SUCCESS;
+}
+
+static int _peb_hydrate(ei_x_buff* x, peb_schema* schema, zval* rv, int depth);
+
+/*
+ * Decodes one value of the field type, anything else fails
+ */
+static int _peb_hydrate_value(ei_x_buff* x, const peb_schema_field* field, zval* rv, int depth)
+{
+    zend_string*    str;
+    peb_schema*     ref;
+    long            long_value;
+    double          double_value;
+    char*           buff;
+    int             type, size;
+
+    if ( ei_get_type(x->buff, &x->index, &type, &size) < 0 ) {
+        return FAILURE;
+    }
+
+    if ( type == ERL_ATOM_EXT ) {
+        if ( (str=_peb_decode_atom(x, size)) == NULL ) {
+            return FAILURE;
+        }
+
+        if ( field->nullable && zend_string_equals_literal(str, "undefined") ) {
+            ZVAL_NULL(rv);
+        }
+        else if ( field->type == PEB_S_ATOM || field->type == PEB_S_TERM ) {
+            ZVAL_STR(rv, str);
+            return SUCCESS;
+        }
+        else if ( field->type == PEB_S_BOOL && zend_string_equals_literal(str, "true") ) {
+            ZVAL_TRUE(rv);
+        }
+        else if ( field->type == PEB_S_BOOL && zend_string_equals_literal(str, "false") ) {
+            ZVAL_FALSE(rv);
+        }
+        else {
+            zend_string_release(str);
+            return FAILURE;
+        }
+
+        zend_string_release(str);
+        return SUCCESS;
+    }
+
+    switch ( field->type ) {
+        case PEB_S_INT:
+            if ( type == ERL_SMALL_BIG_EXT || type == ERL_LARGE_BIG_EXT ) {
+                if ( _peb_decode_big(x, rv) != SUCCESS ) {
+                    return FAILURE;
+                }
+                if ( Z_TYPE_P(rv) != IS_LONG ) {
+                    zval_ptr_dtor(rv);
+                    return FAILURE;
+                }
+                return SUCCESS;
+            }
+            if ( (type != ERL_SMALL_INTEGER_EXT && type != ERL_INTEGER_EXT) ||
+                    ei_decode_long(x->buff, &x->index, &long_value) < 0 ) {
+                return FAILURE;
+            }
+            ZVAL_LONG(rv, long_value);
+            return SUCCESS;
+
+        case PEB_S_FLOAT:
+            /* Integers are widened, as PHP does for float properties */
+            if ( type == ERL_SMALL_INTEGER_EXT || type == ERL_INTEGER_EXT ) {
+                if ( ei_decode_long(x->buff, &x->index, &long_value) < 0 ) {
+                    return FAILURE;
+                }
+                ZVAL_DOUBLE(rv, (double) long_value);
+                return SUCCESS;
+            }
+            if ( (type != NEW_FLOAT_EXT && type != ERL_FLOAT_EXT) ||
+                    ei_decode_double(x->buff, &x->index, &double_value) < 0 ) {
+                return FAILURE;
+            }
+            ZVAL_DOUBLE(rv, double_value);
+            return SUCCESS;
+
+        case PEB_S_STRING:
+            if ( type == ERL_NIL_EXT ) {
+                ZVAL_EMPTY_STRING(rv);
+                x->index += 1;
+                return SUCCESS;
+            }
+            if ( type == ERL_LIST_EXT ) {
+                return _peb_decode_charlist(x, rv);
+            }
+            if ( type == ERL_STRING_EXT ) {
+                if ( size < 0 || size > x->buffsz - x->index - 3 ) {
+                    return FAILURE;
+                }
+                ZVAL_STR(rv, _peb_latin1_to_utf8((const unsigned char*) x->buff + x->index + 3, size));
+                x->index += 3 + size;
+                return SUCCESS;
+            }
+            /* break intentionally missing */
+
+        case PEB_S_BINARY:
+            if ( type != ERL_BINARY_EXT || size < 0 || size > x->buffsz - x->index - 5 ) {
+                return FAILURE;
+            }
+            ZVAL_STRINGL(rv, x->buff + x->index + 5, size);
+            x->index += 5 + size;
+            return SUCCESS;
+
+        case PEB_S_PID:
+            if ( type != ERL_PID_EXT && type != ERL_NEW_PID_EXT ) {
+                return FAILURE;
+            }
+            buff = emalloc(sizeof(erlang_pid));
+            if ( ei_decode_pid(x->buff, &x->index, (erlang_pid*)buff) < 0 ) {
+                efree(buff);
+                return FAILURE;
+            }
+            ZVAL_RES(rv, zend_register_resource(buff, le_serverpid));
+            return SUCCESS;
+
+        case PEB_S_TERM:
+            return _peb_decode(x, rv, 0);
+
+        case PEB_S_SCHEMA:
+            if ( (ref=zend_hash_find_ptr(&PEB_G(schemas), field->ref)) == NULL ) {
+                return FAILURE;
+            }
+            return _peb_hydrate(x, ref, rv, depth + 1);
+    }
+
+    return FAILURE;
+}
+
+/*
+ * Decodes a field value, lists are filled element by element into a packed
+ * array. Lists of small integers come as strings.
+ */
+static int _peb_hydrate_field(ei_x_buff* x, const peb_schema_field* field, zval* rv, int depth)
+{
+    zend_string*    str;
+    zval            z;
+    int             type, size, matched, i;
+    char            tag;
+
+    if ( !field->is_list ) {
+        return _peb_hydrate_value(x, field, rv, depth);
+    }
+
+    if ( ei_get_type(x->buff, &x->index, &type, &size) < 0 ) {
+        return FAILURE;
+    }
+
+    if ( type == ERL_ATOM_EXT && field->nullable ) {
+        if ( (str=_peb_decode_atom(x, size)) == NULL ) {
+            return FAILURE;
+        }
+        matched = zend_string_equals_literal(str, "undefined");
+        zend_string_release(str);
+        if ( !matched ) {
+            return FAILURE;
+        }
+        ZVAL_NULL(rv);
+        return SUCCESS;
+    }
+
+    if ( type == ERL_STRING_EXT ) {
+        if ( field->type != PEB_S_INT && field->type != PEB_S_FLOAT && field->type != PEB_S_TERM ) {
+            return FAILURE;
+        }
+        if ( size < 0 || size > x->buffsz - x->index - 3 ) {
+            return FAILURE;
+        }
+        _peb_array_init_packed(rv, size);
+        for ( i = 0; i < size; i++ ) {
+            if ( field->type == PEB_S_FLOAT ) {
+                ZVAL_DOUBLE(&z, (unsigned char) x->buff[x->index + 3 + i]);
+            }
+            else {
+                ZVAL_LONG(&z, (unsigned char) x->buff[x->index + 3 + i]);
+            }
+            _peb_array_append(rv, &z);
+        }
+        x->index += 3 + size;
+        return SUCCESS;
+    }
+
+    if ( ei_decode_list_header(x->buff, &x->index, &size) < 0 || size > x->buffsz - x->index ) {
+        return FAILURE;
+    }
+
+    _peb_array_init_packed(rv, size);
+    while ( size > 0 ) {
+        for ( ; size > 0; size-- ) {
+            if ( _peb_hydrate_value(x, field, &z, depth) != SUCCESS ) {
+                zval_ptr_dtor(rv);
+                return FAILURE;
+            }
+            _peb_array_append(rv, &z);
+        }
+
+        /* The tail is either [] or a continuation of the list */
+        if ( x->index >= x->buffsz ) {
+            zval_ptr_dtor(rv);
+            return FAILURE;
+        }
+        tag = x->buff[x->index];
+        if ( (tag != ERL_NIL_EXT && tag != ERL_LIST_EXT) ||
+                ei_decode_list_header(x->buff, &x->index, &size) < 0 || size > x->buffsz - x->index ) {
+            zval_ptr_dtor(rv);
+            return FAILURE;
+        }
+        if ( size > 0 ) {
+            zend_hash_extend(Z_ARRVAL_P(rv), zend_hash_num_elements(Z_ARRVAL_P(rv)) + size, 1);
+        }
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Builds the object of a record. The constructor is not called, like
+ * unserialize() does, and every field is stored in its property slot
+ * after the typed property check where the property has a type.
+ */
+static int _peb_hydrate(ei_x_buff* x, peb_schema* schema, zval* rv, int depth)
+{
+    peb_schema_field*   field;
+    zend_string*        tag;
+    zval*               slot;
+    zval                z;
+    int                 arity, type, size, matched;
+    uint32_t            i;
+
+    if ( depth >= PEB_G(max_depth) ) {
+        PEB_G(errorno) = PEB_ERRORNO_DEPTH;
+        PEB_G(error) = estrdup(PEB_ERROR_DEPTH);
+        return FAILURE;
+    }
+
+    if ( _peb_schema_resolve(schema) != SUCCESS ) {
+        return FAILURE;
+    }
+
+    if ( ei_decode_tuple_header(x->buff, &x->index, &arity) < 0 ||
+            (uint32_t) arity != schema->count + (schema->tag != NULL) ) {
+        return FAILURE;
+    }
+
+    if ( schema->tag != NULL ) {
+        if ( ei_get_type(x->buff, &x->index, &type, &size) < 0 || type != ERL_ATOM_EXT ||
+                (tag=_peb_decode_atom(x, size)) == NULL ) {
+            return FAILURE;
+        }
+        matched = zend_string_equals(tag, schema->tag);
+        zend_string_release(tag);
+        if ( !matched ) {
+            return FAILURE;
+        }
+    }
+
+    if ( object_init_ex(rv, schema->ce) != SUCCESS ) {
+        return FAILURE;
+    }
+
+    for ( i = 0; i < schema->count; i++ ) {
+        field = &schema->fields[i];
+        if ( _peb_hydrate_field(x, field, &z, depth) != SUCCESS ) {
+            zval_ptr_dtor(rv);
+            return FAILURE;
+        }
+
+#if PHP_VERSION_ID >= 70400
+        if ( ZEND_TYPE_IS_SET(field->info->type) && !zend_verify_property_type(field->info, &z, 1) ) {
+            zval_ptr_dtor(&z);
+            zval_ptr_dtor(rv);
+            return FAILURE;
+        }
+#endif
+
+        slot = OBJ_PROP(Z_OBJ_P(rv), field->info->offset);
+        zval_ptr_dtor(slot);
+        ZVAL_COPY_VALUE(slot, &z);
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Registers a schema for peb_decode_as(), kept for the life of the worker
+ *
+ * Prototype:
+ *      bool peb_register_schema(string name, string class, string spec)
+ *
+ * Parameters:
+ *      name            schema name
+ *      class           class of the objects
+ *      spec            record layout, e.g. "{user, id:int, name:binary, roles:[atom]}",
+ *                      each field is set to the property of the same name
+ *
+ * Return:
+ *     true             success, also when the same schema is registered again
+ *     false            invalid spec
+ */
+PHP_FUNCTION(peb_register_schema)
+{
+    zend_string*    name;
+    zend_string*    class_name;
+    zend_string*    spec;
+    peb_schema*     schema;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "SSS", &name, &class_name, &spec) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    /* Bootstrap code registers its schemas in every request */
+    if ( (schema=zend_hash_find_ptr(&PEB_G(schemas), name)) != NULL &&
+            zend_string_equals(schema->spec, spec) &&
+            zend_string_equals_ci(schema->class_name, class_name) ) {
+        RETURN_TRUE;
+    }
+
+    if ( (schema=_peb_schema_compile(class_name, spec)) == NULL ) {
+        PEB_G(errorno) = PEB_ERRORNO_SCHEMA;
+        PEB_G(error) = estrdup(PEB_ERROR_SCHEMA);
+        RETURN_FALSE;
+    }
+
+    zend_hash_str_update_ptr(&PEB_G(schemas), ZSTR_VAL(name), ZSTR_LEN(name), schema);
+
+    RETURN_TRUE;
+}
+
+/*
+ * Decodes records straight into objects of a registered schema
+ *
+ * Prototype:
+ *      mixed peb_decode_as(mixed term, string schema)
+ *
+ * Parameters:
+ *      term            message resource or PebTerm
+ *      schema          schema name
+ *
+ * Return:
+ *     object           the record as an object of the schema class
+ *     array            the objects, when the term is a list of records
+ *     false            unknown schema, or the term does not match it
+ */
+PHP_FUNCTION(peb_decode_as)
+{
+    zval*               term;
+    zend_string*        name;
+    ei_x_buff*          x;
+    ei_x_buff           view;
+    peb_schema_field    list;
+    peb_schema*         schema;
+    int                 index, type, size, result;
+
+    PEB_G(error) = NULL;
+    PEB_G(errorno) = 0;
+
+    if ( zend_parse_parameters(ZEND_NUM_ARGS(), "zS", &term, &name) == FAILURE )  {
+        RETURN_FALSE;
+    }
+
+    if ( (x=_peb_term_arg(term, &index)) == NULL ) {
+        RETURN_FALSE;
+    }
+
+    if ( (schema=zend_hash_find_ptr(&PEB_G(schemas), name)) == NULL ) {
+        PEB_G(errorno) = PEB_ERRORNO_SCHEMA;
+        PEB_G(error) = estrdup(PEB_ERROR_SCHEMA);
+        RETURN_FALSE;
+    }
+
+    view = *x;
+    view.index = index;
+
+    if ( ei_get_type(view.buff, &view.index, &type, &size) == 0 && (type == ERL_LIST_EXT || type == ERL_NIL_EXT) ) {
+        memset(&list, 0, sizeof(list));
+        list.type = PEB_S_SCHEMA;
+        list.is_list = 1;
+        list.ref = name;
+        result = _peb_hydrate_field(&view, &list, return_value, -1);
+    }
+    else {
+        result = _peb_hydrate(&view, schema, return_value, 0);
+    }
+
+    if ( result != SUCCESS ) {
+        if ( PEB_G(errorno) == 0 ) {
+            PEB_G(errorno) = PEB_ERRORNO_SCHEMA;
+            PEB_G(error) = estrdup(PEB_ERROR_SCHEMA);
+        }
+        RETURN_FALSE;
+    }
 }
 
 /*
@@ -69,6 +69,22 @@
 #define PEB_ERROR_NOTMINE		    "ei_receive got a message but not mine"
 #define PEB_ERRORNO_DECODE          6
 #define PEB_ERROR_DECODE		    "ei_decode error, unsupported data type"
+#define PEB_ERRORNO_FORMAT          7
+#define PEB_ERROR_FORMAT		    "ei_encode error, invalid format string"
+#define PEB_ERRORNO_ENCODE          8
+#define PEB_ERROR_ENCODE		    "ei_encode error, data does not match format"
+#define PEB_ERRORNO_DEPTH           9
+#define PEB_ERROR_DEPTH		        "term nesting exceeds peb.max_depth"
+#define PEB_ERRORNO_VECTOR          10
+#define PEB_ERROR_VECTOR		    "unknown vector type or blob size"
+#define PEB_ERRORNO_JSON            11
+#define PEB_ERROR_JSON		        "invalid JSON, or term without JSON equivalent"
+#define PEB_ERRORNO_SCHEMA          12
+#define PEB_ERROR_SCHEMA		    "invalid or unknown schema, or term does not match it"
+#define PEB_ERRORNO_TIMEOUT         13
+#define PEB_ERROR_TIMEOUT		    "timed out waiting for a reply"
+#define PEB_ERRORNO_DEADLINE        14
+#define PEB_ERROR_DEADLINE		    "request deadline exceeded"
 
 /****************************************
 	Resource names
@@ -76,9 +92,29 @@
 #define PEB_RESOURCENAME		    "PHP-Erlang Bridge"
 #define PEB_TERMRESOURCE		    "Erlang Term"
 #define PEB_SERVERPID			    "Erlang Pid"
+#define PEB_RPCRESOURCE			    "Erlang RPC"
 
 #define PEB_DEFAULT_TMO			    1000        /* Default timeout in milliseconds */
 
+#define PEB_FMT_CACHE_SIZE          512         /* Max compiled formats kept per worker */
+#define PEB_ATOM_CACHE_SIZE         4096        /* Max atoms kept per worker */
+
+/****************************************
+	Codec options
+****************************************/
+#define PEB_OPT_PROPLISTS           0x01        /* [{Key, Value}] <=> assoc arrays */
+#define PEB_OPT_ATOM_KEYS           0x02        /* string keys are encoded as atoms */
+#define PEB_OPT_CHARLISTS           0x04        /* Erlang strings are decoded to UTF-8 strings */
+#define PEB_OPT_JSON_PLAIN_ATOMS    0x08        /* true, false and undefined stay JSON strings */
+#define PEB_OPT_JSON_BASE64         0x10        /* binaries are written as base64 JSON strings */
+#define PEB_OPT_JSON_TUPLES         0x20        /* tuples <=> {"tuple": [...]} JSON objects */
+
+/****************************************
+	Pool strategies
+****************************************/
+#define PEB_POOL_LEAST_LOADED       0           /* an idle link, else a new one, else the least busy */
+#define PEB_POOL_ROUND_ROBIN        1           /* every link in turn, opened as they come up */
+
 extern zend_module_entry peb_module_entry;
 #define phpext_peb_ptr (&peb_module_entry)
 
@@ -101,15 +137,40 @@ PHP_MINFO_FUNCTION(peb);
 PHP_FUNCTION(peb_connect);
 PHP_FUNCTION(peb_pconnect);
 PHP_FUNCTION(peb_close);
+PHP_FUNCTION(peb_set_deadline);
+PHP_FUNCTION(peb_pool_acquire);
+PHP_FUNCTION(peb_pool_release);
 PHP_FUNCTION(peb_send_byname);
 PHP_FUNCTION(peb_rpc);
 PHP_FUNCTION(peb_rpc_to);
+PHP_FUNCTION(peb_rpc_async);
+PHP_FUNCTION(peb_await);
+PHP_FUNCTION(peb_await_all);
 PHP_FUNCTION(peb_send_bypid);
+PHP_FUNCTION(peb_send_many);
 PHP_FUNCTION(peb_receive);
+PHP_FUNCTION(peb_send_raw);
+PHP_FUNCTION(peb_receive_raw);
 PHP_FUNCTION(peb_encode);
 PHP_FUNCTION(peb_vencode);
+PHP_FUNCTION(peb_encode_value);
+PHP_FUNCTION(peb_vencode_value);
 PHP_FUNCTION(peb_decode);
 PHP_FUNCTION(peb_vdecode);
+PHP_FUNCTION(peb_decode_lazy);
+PHP_FUNCTION(peb_vdecode_lazy);
+PHP_FUNCTION(peb_term_get);
+PHP_FUNCTION(peb_term_get_many);
+PHP_FUNCTION(peb_term_to_string);
+PHP_FUNCTION(peb_string_to_term);
+PHP_FUNCTION(peb_decode_iter);
+PHP_FUNCTION(peb_decode_columns);
+PHP_FUNCTION(peb_pack_vector);
+PHP_FUNCTION(peb_unpack_vector);
+PHP_FUNCTION(peb_term_to_json);
+PHP_FUNCTION(peb_json_to_term);
+PHP_FUNCTION(peb_register_schema);
+PHP_FUNCTION(peb_decode_as);
 PHP_FUNCTION(peb_error);
 PHP_FUNCTION(peb_errorno);
 
@@ -119,6 +180,22 @@ PHP_FUNCTION(peb_status);
 
 PHP_FUNCTION(peb_print_term);
 
+PHP_METHOD(PebTerm, __construct);
+PHP_METHOD(PebTerm, offsetGet);
+PHP_METHOD(PebTerm, offsetExists);
+PHP_METHOD(PebTerm, offsetSet);
+PHP_METHOD(PebTerm, offsetUnset);
+PHP_METHOD(PebTerm, count);
+PHP_METHOD(PebTerm, getIterator);
+PHP_METHOD(PebTerm, toArray);
+
+PHP_METHOD(PebListIterator, __construct);
+PHP_METHOD(PebListIterator, current);
+PHP_METHOD(PebListIterator, key);
+PHP_METHOD(PebListIterator, next);
+PHP_METHOD(PebListIterator, rewind);
+PHP_METHOD(PebListIterator, valid);
+
 ZEND_BEGIN_MODULE_GLOBALS(peb)
 	// char *default_nodename;
 	// char *default_cookie;
@@ -132,6 +209,28 @@ ZEND_BEGIN_MODULE_GLOBALS(peb)
 	char*           error;
 
 	long            instanceid;
+
+	HashTable       fmt_cache;      /* format string => compiled program */
+	HashTable       atom_cache;     /* atom name => interned name and encoded atom */
+	HashTable       atom_wire;      /* encoded atom as received => atom_cache entry */
+	HashTable       schemas;        /* schema name => compiled schema */
+	zend_ulong      schema_gen;     /* bumped every request, see _peb_schema_resolve() */
+
+	HashTable       pools;          /* "peb_<node>_<cookie>" => peb_pool */
+	zend_long       pool_min;       /* peb.pool_min */
+	zend_long       pool_max;       /* peb.pool_max */
+	int             pool_seq;       /* numbers the C nodes of pooled links */
+	zend_long       link_max_idle;  /* peb.link_max_idle, seconds */
+
+	HashTable       rpc_pending;    /* sequence => peb_rpc_handle waiting for its reply */
+	zend_ulong      rpc_seq;
+
+	zend_long       request_timeout; /* peb.request_timeout, milliseconds */
+	zend_long       deadline;       /* request deadline, see _peb_deadline() */
+
+	zend_long       max_depth;      /* peb.max_depth */
+	void*           stack;          /* codec stack, reused across calls */
+	size_t          stack_size;
 ZEND_END_MODULE_GLOBALS(peb)
 
 /* In every utility function you add that needs to use variables